@@ -87,3 +87,83 @@ auto arch_get_memtotal() -> uint64_t
 
 #endif
 }
+
+
+auto arch_get_cachesize(unsigned int level) -> uint64_t
+{
+  /* size of the data or unified cache at level 1, 2 or 3, or 0 if
+     there is no such cache or the size is unknown */
+
+#ifdef _WIN32
+
+  DWORD length = 0;
+  GetLogicalProcessorInformation(nullptr, &length);
+  std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info
+    (length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+  uint64_t size = 0;
+  if (GetLogicalProcessorInformation(info.data(), &length))
+    {
+      for(auto & i : info)
+        {
+          if ((i.Relationship == RelationCache) &&
+              (i.Cache.Level == level) &&
+              (i.Cache.Type != CacheInstruction)) {
+            size = std::max(size, static_cast<uint64_t>(i.Cache.Size));
+          }
+        }
+    }
+  return size;
+
+#elif defined(__APPLE__)
+
+  static const char * const names[] =
+    {"hw.l1dcachesize", "hw.l2cachesize", "hw.l3cachesize"};
+  if ((level < 1) || (level > 3)) {
+    return 0;
+  }
+  int64_t size = 0;
+  size_t length = sizeof(size);
+  if ((sysctlbyname(names[level - 1], &size, &length, nullptr, 0) == 0) &&
+      (size > 0)) {
+    return static_cast<uint64_t>(size);
+  }
+  return 0;
+
+#elif defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL3_CACHE_SIZE)
+
+  static const int names[] =
+    {_SC_LEVEL1_DCACHE_SIZE, _SC_LEVEL2_CACHE_SIZE, _SC_LEVEL3_CACHE_SIZE};
+  if ((level < 1) || (level > 3)) {
+    return 0;
+  }
+  const int64_t size = sysconf(names[level - 1]);
+  return (size > 0) ? static_cast<uint64_t>(size) : 0;
+
+#else
+
+  return 0;
+
+#endif
+}
+
+
+auto arch_dlopen(const char * name) -> void *
+{
+  /* load a shared library at run time, return nullptr if not found */
+
+#ifdef _WIN32
+  return static_cast<void *>(LoadLibraryA(name));
+#else
+  return dlopen(name, RTLD_LAZY);
+#endif
+}
+
+
+auto arch_dlsym(void * handle, const char * name) -> void *
+{
+#ifdef _WIN32
+  return reinterpret_cast<void *>(GetProcAddress(static_cast<HMODULE>(handle), name));
+#else
+  return dlsym(handle, name);
+#endif
+}
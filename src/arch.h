@@ -22,3 +22,17 @@
 // operating system specific functions (Windows, macOS and Linux)
 auto arch_get_memused() -> uint64_t;
 auto arch_get_memtotal() -> uint64_t;
+auto arch_get_cachesize(unsigned int level) -> uint64_t;
+auto arch_dlopen(const char * name) -> void *;
+auto arch_dlsym(void * handle, const char * name) -> void *;
+
+// architecture specific inline functions
+
+__extension__ typedef unsigned __int128 arch_uint128_t;  // gcc and clang, 64 bit
+
+inline auto arch_fastrange64(uint64_t x, uint64_t n) -> uint64_t
+{
+  /* map x uniformly to the range 0 to n-1 without a division, using
+     the high 64 bits of the 128 bit product (Lemire's fastrange) */
+  return static_cast<uint64_t>((static_cast<arch_uint128_t>(x) * n) >> 64U);
+}
@@ -20,60 +20,145 @@
 */
 
 /*
-  Blocked bloom filter with precomputed bit patterns
-  as described in
+  Blocked bloom filter with one word per key, as described in
 
   Putze F, Sanders P, Singler J (2009)
   Cache-, Hash- and Space-Efficient Bloom Filters
   Journal of Experimental Algorithmics, 14, 4
   https://doi.org/10.1145/1498698.1594230
+
+  The pattern of a key is made from two random half patterns, each
+  chosen by 10 bits of its hash, with half of the k bits each. The
+  two tables take 16 kB and stay in the level 1 cache, unlike a table
+  of whole patterns. The bits of the halves may overlap, so a pattern
+  may have fewer than k bits set.
 */
 
 #include "main.h"
 
-auto bloomflex_patterns_generate(struct bloomflex_s * b) -> void
+auto bloomflex_halves_generate(struct bloomflex_s * b) -> void
 {
+  /*
+    The halves only depend on k, as an index file does not store
+    them, so they come from a generator of their own with a fixed
+    seed.
+  */
+
   static constexpr unsigned int max_range {63};  // i & max_range = cap values to 63 max
-  for(auto i = 0U; i < b->pattern_count; i++)
+  static constexpr uint64_t halves_seed {1};
+  std::mt19937_64 rng(halves_seed);
+  for(auto half = 0U; half < bloomflex_halves; half++)
     {
-      uint64_t pattern {0};
-      for(auto j = 0U; j < b->pattern_k; j++)
+      const uint64_t bits = (b->pattern_k + 1 - half) / bloomflex_halves;
+      for(auto i = 0U; i < bloomflex_half_count; i++)
         {
-          uint64_t onebit {0};
-          onebit = 1ULL << (rand_64() & max_range);  // 0 <= shift <= 63
-          while ((pattern & onebit) != 0U) {
-            onebit = 1ULL << (rand_64() & max_range);
-          }
-          pattern |= onebit;
+          uint64_t pattern {0};
+          for(auto j = 0U; j < bits; j++)
+            {
+              uint64_t onebit {0};
+              onebit = 1ULL << (rng() & max_range);  // 0 <= shift <= 63
+              while ((pattern & onebit) != 0U) {
+                onebit = 1ULL << (rng() & max_range);
+              }
+              pattern |= onebit;
+            }
+          b->halves[half][i] = pattern;
         }
-      b->patterns[i] = pattern;
     }
 }
 
 
-struct bloomflex_s * bloomflex_init(const uint64_t size, const unsigned int k)
+auto bloomflex_create(const uint64_t size, const unsigned int k)
+  -> struct bloomflex_s *
 {
-  /* Input size is in bytes for full bitmap */
+  /* the structure with its halves, but no bitmap, size in longs */
 
-  bloomflex_s * b = (struct bloomflex_s *) xmalloc(sizeof(struct bloomflex_s));
-  b->size = (size + 7) / 8;
-  b->pattern_shift = 15;
-  b->pattern_count = 1 << b->pattern_shift;
-  b->pattern_mask = b->pattern_count - 1;
+  auto * b = static_cast<struct bloomflex_s *>(xmalloc(sizeof(struct bloomflex_s)));
+  b->size = size;
   b->pattern_k = k;
+  b->bitmap = nullptr;
+  bloomflex_halves_generate(b);
+  return b;
+}
+
 
-  b->patterns = (uint64_t *) xmalloc(b->pattern_count * sizeof(uint64_t));
-  bloomflex_patterns_generate(b);
+struct bloomflex_s * bloomflex_init(const uint64_t size, const unsigned int k)
+{
+  /* Input size is in bytes for full bitmap */
+
+  bloomflex_s * b = bloomflex_create((size + 7) / 8, k);
 
-  b->bitmap = (uint64_t *) xmalloc(size);
-  memset(b->bitmap, UINT8_MAX, size);
+  /* whole words, the last one may be addressed */
+  b->bitmap = (uint64_t *) xmalloc_large(b->size * sizeof(uint64_t));
+  memset(b->bitmap, UINT8_MAX, b->size * sizeof(uint64_t));
 
   return b;
 }
 
+auto bloomflex_fpr(double bits_per_key, unsigned int k) -> double
+{
+  /*
+    The keys that share a word follow a Poisson distribution, with
+    64 / bits_per_key keys per word on average. The halves of a
+    pattern have a and b bits, of which o overlap with a
+    hypergeometric distribution, so the pattern has j = k - o bits. A
+    key that is not in the filter passes if all j bits of its pattern
+    are set in its word by the i keys stored there.
+  */
+
+  static constexpr unsigned int word_bits {64};
+  static constexpr unsigned int max_keys {256};
+  const unsigned int a = (k + 1) / 2;
+  const unsigned int b = k / 2;
+
+  auto choose = [](unsigned int n, unsigned int r) -> double
+    {
+      double c = 1;
+      for(auto i = 0U; i < r; i++) {
+        c = c * (n - i) / (i + 1);
+      }
+      return c;
+    };
+
+  std::vector<double> p_overlap(b + 1);
+  double bits = 0;
+  for(auto o = 0U; o <= b; o++)
+    {
+      p_overlap[o] = choose(a, o) * choose(word_bits - a, b - o) /
+        choose(word_bits, b);
+      bits += p_overlap[o] * (k - o);
+    }
+
+  const double lambda = word_bits / bits_per_key;
+  double p_keys = std::exp(- lambda);
+  double fpr = 0;
+  for(auto i = 0U; i < max_keys; i++)
+    {
+      if (i > 0) {
+        p_keys *= lambda / i;
+      }
+      const double p_bit = 1 - std::pow(1 - bits / word_bits, i);
+      for(auto o = 0U; o <= b; o++) {
+        fpr += p_keys * p_overlap[o] * std::pow(p_bit, k - o);
+      }
+    }
+  return fpr;
+}
+
+auto bloomflex_best_k(double bits_per_key) -> unsigned int
+{
+  unsigned int best = 1;
+  for(auto k = 2U; k <= bloomflex_max_k; k++)
+    {
+      if (bloomflex_fpr(bits_per_key, k) < bloomflex_fpr(bits_per_key, best)) {
+        best = k;
+      }
+    }
+  return best;
+}
+
 auto bloomflex_exit(struct bloomflex_s * b) -> void
 {
-  xfree(b->bitmap);
-  xfree(b->patterns);
+  xfree_large(b->bitmap, b->size * sizeof(uint64_t));
   xfree(b);
 }
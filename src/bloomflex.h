@@ -19,29 +19,54 @@
     PO Box 1080 Blindern, NO-0316 Oslo, Norway
 */
 
+constexpr unsigned int bloomflex_max_k {16};  /* bits per pattern */
+constexpr unsigned int bloomflex_halves {2};  /* half patterns per pattern */
+constexpr unsigned int bloomflex_half_shift {10};  /* hash bits per half */
+constexpr unsigned int bloomflex_half_count {1U << bloomflex_half_shift};
+
 struct bloomflex_s
 {
   uint64_t size; /* size in number of longs (8 bytes) */
-  uint64_t pattern_shift;
-  uint64_t pattern_count;
-  uint64_t pattern_mask;
   uint64_t pattern_k;
   uint64_t * bitmap;
-  uint64_t * patterns;
+  uint64_t halves[bloomflex_halves][bloomflex_half_count];
 };
 
 auto bloomflex_init(uint64_t size, unsigned int k) -> struct bloomflex_s *;
 
+/* the filter without a bitmap, with the size in longs */
+auto bloomflex_create(uint64_t size, unsigned int k) -> struct bloomflex_s *;
+
+/* expected false positive rate with the given bits per key and k */
+auto bloomflex_fpr(double bits_per_key, unsigned int k) -> double;
+
+/* the number of bits per pattern with the lowest false positive rate */
+auto bloomflex_best_k(double bits_per_key) -> unsigned int;
+
 void bloomflex_exit(struct bloomflex_s * b);
 
 inline auto bloomflex_adr(struct bloomflex_s * b, uint64_t h) -> uint64_t *
 {
-  return b->bitmap + ((h >> b->pattern_shift) % b->size);
+  /* the high bits of h select the word, the low bits the pattern */
+  return b->bitmap + arch_fastrange64(h, b->size);
 }
 
 inline auto bloomflex_pat(struct bloomflex_s * b, uint64_t h) -> uint64_t
 {
-  return b->patterns[h & b->pattern_mask];
+  /*
+    Two halves from tables small enough to stay in the level 1 cache,
+    chosen by bits 0-9 and 24-33 of h, apart from the bits used for
+    the word and for the fingerprints of the hash table.
+  */
+  static constexpr uint64_t mask {bloomflex_half_count - 1};
+  static constexpr unsigned int second_shift {24};
+  return b->halves[0][h & mask] | b->halves[1][(h >> second_shift) & mask];
+}
+
+inline void bloomflex_prefetch(struct bloomflex_s * b, uint64_t h)
+{
+  /* start loading the bitmap word, to be tested later */
+  __builtin_prefetch(bloomflex_adr(b, h));
 }
 
 inline void bloomflex_set(struct bloomflex_s * b, uint64_t h)
@@ -49,6 +74,12 @@ inline void bloomflex_set(struct bloomflex_s * b, uint64_t h)
   * bloomflex_adr(b, h) &= ~ bloomflex_pat(b, h);
 }
 
+inline void bloomflex_set_shared(struct bloomflex_s * b, uint64_t h)
+{
+  /* as bloomflex_set, while other threads set other keys */
+  __atomic_fetch_and(bloomflex_adr(b, h), ~ bloomflex_pat(b, h), __ATOMIC_RELAXED);
+}
+
 inline auto bloomflex_get(struct bloomflex_s * b, uint64_t h) -> bool
 {
   return (* bloomflex_adr(b, h) & bloomflex_pat(b, h)) == 0U;
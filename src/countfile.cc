@@ -0,0 +1,276 @@
+/*
+    Copyright (C) 2012-2023 Torbjorn Rognes and Frederic Mahe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Torbjorn Rognes <torognes@ifi.uio.no>,
+    Department of Informatics, University of Oslo,
+    PO Box 1080 Blindern, NO-0316 Oslo, Norway
+*/
+
+#include "main.h"
+
+static constexpr char countfile_magic[8] {'K', 'M', 'C', 'C', 'O', 'U', 'N', 'T'};
+static constexpr uint32_t countfile_byteorder {0x01020304};
+static constexpr uint32_t countfile_flag_canonical {1};
+static constexpr uint32_t countfile_flag_strand_counts {2};
+
+enum countfile_section
+  {
+    countfile_kmers,
+    countfile_counts,
+    countfile_reverse_counts,
+    countfile_sections
+  };
+
+struct countfile_header_s
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byteorder;
+  uint32_t k;
+  uint32_t flags;
+  uint64_t entries;
+  uint64_t total;
+  uint64_t count_width;
+  uint64_t section_offset[countfile_sections];
+  uint64_t section_size[countfile_sections];
+};
+
+auto countfile_layout(struct countfile_header_s * h) -> void
+{
+  /* each array follows the previous one, at a multiple of 8 bytes */
+
+  const bool strand_counts = (h->flags & countfile_flag_strand_counts) != 0;
+  h->section_size[countfile_kmers] = h->entries * sizeof(uint64_t);
+  h->section_size[countfile_counts] = h->entries * h->count_width;
+  h->section_size[countfile_reverse_counts] =
+    strand_counts ? h->entries * h->count_width : 0;
+
+  uint64_t offset = sizeof(struct countfile_header_s);
+  for(auto i = 0U; i < countfile_sections; i++)
+    {
+      h->section_offset[i] = offset;
+      offset += (h->section_size[i] + 7) / 8 * 8;
+    }
+}
+
+auto countfile_pack(struct writer_s * w, const uint64_t * values,
+                    uint64_t entries, unsigned int width) -> void
+{
+  /* the low bytes of each value, padded to a multiple of 8 bytes */
+
+  static constexpr uint64_t block {4096};
+  unsigned char buffer[block * sizeof(uint64_t)];
+  for(uint64_t first = 0; first < entries; first += block)
+    {
+      const uint64_t last = std::min(first + block, entries);
+      unsigned char * p = buffer;
+      for(uint64_t i = first; i < last; i++)
+        {
+          const uint64_t v = values[i];
+          switch (width)
+            {
+            case 1:
+              * p = static_cast<unsigned char>(v);
+              break;
+            case 2:
+              {
+                auto v16 = static_cast<uint16_t>(v);
+                memcpy(p, &v16, sizeof(v16));
+                break;
+              }
+            case 4:
+              {
+                auto v32 = static_cast<uint32_t>(v);
+                memcpy(p, &v32, sizeof(v32));
+                break;
+              }
+            default:
+              memcpy(p, &v, sizeof(v));
+            }
+          p += width;
+        }
+      writer_write(w, reinterpret_cast<char *>(buffer),
+                   static_cast<uint64_t>(p - buffer));
+    }
+
+  static const char zeros[8] {0};
+  const uint64_t size = entries * width;
+  writer_write(w, zeros, (size + 7) / 8 * 8 - size);
+}
+
+auto countfile_write(std::FILE * fp, unsigned int k, bool canonical,
+                     uint64_t entries, const uint64_t * kmers,
+                     const uint64_t * counts, const uint64_t * reverse)
+  -> void
+{
+  struct countfile_header_s h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, countfile_magic, sizeof(h.magic));
+  h.version = countfile_version;
+  h.byteorder = countfile_byteorder;
+  h.k = k;
+  h.flags = (canonical ? countfile_flag_canonical : 0) |
+    ((reverse != nullptr) ? countfile_flag_strand_counts : 0);
+  h.entries = entries;
+
+  /* the smallest width that fits the largest count */
+
+  uint64_t largest = 0;
+  for(uint64_t i = 0; i < entries; i++)
+    {
+      h.total += counts[i];
+      largest = std::max(largest, counts[i]);
+    }
+  h.count_width = 1;
+  while ((h.count_width < sizeof(uint64_t)) &&
+         (largest >> (8 * h.count_width) != 0)) {
+    h.count_width *= 2;
+  }
+
+  countfile_layout(&h);
+
+  struct writer_s * w = writer_init(fp);
+  writer_write(w, reinterpret_cast<char *>(&h), sizeof(h));
+  writer_write(w, reinterpret_cast<const char *>(kmers),
+               h.section_size[countfile_kmers]);
+  const auto width = static_cast<unsigned int>(h.count_width);
+  countfile_pack(w, counts, entries, width);
+  if (reverse != nullptr) {
+    countfile_pack(w, reverse, entries, width);
+  }
+  writer_exit(w);
+}
+
+auto countfile_load(const char * filename, struct countfile_s * c) -> void
+{
+  /* map the file, or read it into memory where it cannot be mapped */
+
+  std::FILE * fp = fopen_input(filename);
+  if (fp == nullptr) {
+    fatal(error_prefix, "Unable to open count file for reading.");
+  }
+
+  struct stat fs;
+  if ((fstat(fileno(fp), & fs) != 0) || ! S_ISREG(fs.st_mode)) {
+    fatal(error_prefix, "The count file must be a regular file.");
+  }
+  c->map_size = static_cast<uint64_t>(fs.st_size);
+  if (c->map_size < sizeof(struct countfile_header_s)) {
+    fatal(error_prefix, "The file ", filename, " is not a kmercount count file.");
+  }
+
+  c->map = nullptr;
+  c->is_mapped = false;
+
+#ifndef _WIN32
+  void * map = mmap(nullptr, c->map_size, PROT_READ, MAP_PRIVATE,
+                    fileno(fp), 0);
+  if (map != MAP_FAILED)
+    {
+      c->map = map;
+      c->is_mapped = true;
+    }
+#endif
+
+  if (! c->is_mapped)
+    {
+      c->map = xmalloc(c->map_size);
+      if (fread(c->map, 1, c->map_size, fp) != c->map_size) {
+        fatal(error_prefix, "Unable to read count file.");
+      }
+    }
+
+  fclose(fp);
+}
+
+auto countfile_read(const char * filename) -> struct countfile_s *
+{
+  auto * c = static_cast<struct countfile_s *>(xmalloc(sizeof(struct countfile_s)));
+  countfile_load(filename, c);
+
+  /* check the header */
+
+  struct countfile_header_s h;
+  memcpy(&h, c->map, sizeof(h));
+
+  if (memcmp(h.magic, countfile_magic, sizeof(h.magic)) != 0) {
+    fatal(error_prefix, "The file ", filename, " is not a kmercount count file.");
+  }
+  if (h.byteorder != countfile_byteorder) {
+    fatal(error_prefix, "The count file was written on a machine with another byte order.");
+  }
+  if (h.version != countfile_version) {
+    fatal(error_prefix, "The count file has version ", h.version,
+          ", but this program reads version ", countfile_version, ".");
+  }
+
+  const struct countfile_header_s given = h;
+  bool ok = (h.k >= 1) && (h.k <= 32) &&
+    ((h.count_width == 1) || (h.count_width == 2) ||
+     (h.count_width == 4) || (h.count_width == 8)) &&
+    (h.entries <= c->map_size / sizeof(uint64_t));
+  if (ok) {
+    countfile_layout(&h);
+  }
+  for(auto i = 0U; i < countfile_sections; i++)
+    {
+      ok = ok && (h.section_size[i] == given.section_size[i]) &&
+        (h.section_offset[i] == given.section_offset[i]) &&
+        (h.section_offset[i] <= c->map_size) &&
+        (h.section_size[i] <= c->map_size - h.section_offset[i]);
+    }
+  if (! ok) {
+    fatal(error_prefix, "The count file is damaged.");
+  }
+
+  auto * base = static_cast<unsigned char *>(c->map);
+  c->k = h.k;
+  c->canonical = (h.flags & countfile_flag_canonical) != 0;
+  c->strand_counts = (h.flags & countfile_flag_strand_counts) != 0;
+  c->entries = h.entries;
+  c->total = h.total;
+  c->count_width = static_cast<unsigned int>(h.count_width);
+  c->kmers = reinterpret_cast<const uint64_t *>
+    (base + h.section_offset[countfile_kmers]);
+  c->counts = base + h.section_offset[countfile_counts];
+  c->reverse = c->strand_counts ?
+    base + h.section_offset[countfile_reverse_counts] : nullptr;
+
+  return c;
+}
+
+auto countfile_find(const struct countfile_s * c, uint64_t kmer) -> uint64_t
+{
+  const uint64_t * p = std::lower_bound(c->kmers, c->kmers + c->entries, kmer);
+  if ((p != c->kmers + c->entries) && (* p == kmer)) {
+    return static_cast<uint64_t>(p - c->kmers);
+  }
+  return c->entries;
+}
+
+auto countfile_exit(struct countfile_s * c) -> void
+{
+#ifndef _WIN32
+  if (c->is_mapped) {
+    munmap(c->map, c->map_size);
+  }
+  else
+#endif
+    {
+      xfree(c->map);
+    }
+  xfree(c);
+}
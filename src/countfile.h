@@ -0,0 +1,105 @@
+/*
+    Copyright (C) 2012-2023 Torbjorn Rognes and Frederic Mahe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Torbjorn Rognes <torognes@ifi.uio.no>,
+    Department of Informatics, University of Oslo,
+    PO Box 1080 Blindern, NO-0316 Oslo, Norway
+*/
+
+/*
+  Binary count file, written with --output-format binary and turned
+  back into text with kmercount view. A header with the kmer length,
+  the flags and the number of entries is followed by the kmers, sorted
+  by their 2-bit code (first nt in the lowest bits), and then their
+  counts and, with strand counts, their reverse counts. The counts are
+  stored in the smallest of 1, 2, 4 or 8 bytes that fits them all, so
+  that the counts of any kmer can be found by a binary search in the
+  mapped file.
+
+  The file is written in the byte order of the machine, and must be
+  read on a machine with the same byte order.
+*/
+
+constexpr uint32_t countfile_version {1};
+
+struct countfile_s
+{
+  unsigned int k;
+  bool canonical;             /* both strands were counted */
+  bool strand_counts;         /* with reverse counts */
+  uint64_t entries;
+  uint64_t total;             /* the sum of the counts */
+  unsigned int count_width;   /* bytes per count */
+  const uint64_t * kmers;
+  const unsigned char * counts;
+  const unsigned char * reverse;  /* or nullptr */
+  void * map;
+  uint64_t map_size;
+  bool is_mapped;             /* mapped, or else read into memory */
+};
+
+inline auto countfile_value(const unsigned char * values, unsigned int width,
+                            uint64_t i) -> uint64_t
+{
+  const unsigned char * p = values + i * width;
+  switch (width)
+    {
+    case 1:
+      return * p;
+    case 2:
+      {
+        uint16_t v = 0;
+        memcpy(&v, p, sizeof(v));
+        return v;
+      }
+    case 4:
+      {
+        uint32_t v = 0;
+        memcpy(&v, p, sizeof(v));
+        return v;
+      }
+    default:
+      {
+        uint64_t v = 0;
+        memcpy(&v, p, sizeof(v));
+        return v;
+      }
+    }
+}
+
+inline auto countfile_count(const struct countfile_s * c, uint64_t i)
+  -> uint64_t
+{
+  return countfile_value(c->counts, c->count_width, i);
+}
+
+inline auto countfile_reverse(const struct countfile_s * c, uint64_t i)
+  -> uint64_t
+{
+  return c->reverse ? countfile_value(c->reverse, c->count_width, i) : 0;
+}
+
+auto countfile_write(std::FILE * fp, unsigned int k, bool canonical,
+                     uint64_t entries, const uint64_t * kmers,
+                     const uint64_t * counts, const uint64_t * reverse)
+  -> void;
+
+auto countfile_read(const char * filename) -> struct countfile_s *;
+
+/* the entry of the kmer, or c->entries if it is not in the file */
+auto countfile_find(const struct countfile_s * c, uint64_t kmer) -> uint64_t;
+
+auto countfile_exit(struct countfile_s * c) -> void;
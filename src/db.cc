@@ -21,35 +21,24 @@
 
 #include "main.h"
 
-
 constexpr unsigned int memchunk {1 << 20};  // 1 megabyte
+constexpr unsigned int max_chunks {48};  // each twice the previous one
+constexpr unsigned int inputchunk {1 << 20};  // 1 megabyte
 constexpr unsigned int linealloc {2048};
-
-static const signed char map_nt[256] =
-  {
-    // AaNn = 0, Cc = 1, Gg = 2, TtUu = 3, rest = -1
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1,  0, -1,  1, -1, -1, -1,  2, -1, -1, -1, -1, -1, -1,  0, -1,
-    -1, -1, -1, -1,  3,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1,  0, -1,  1, -1, -1, -1,  2, -1, -1, -1, -1, -1, -1,  0, -1,
-    -1, -1, -1, -1,  3,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
-  };
+constexpr uint64_t releasechunk {1 << 26};  // 64 megabytes
+constexpr unsigned int quality_offset {33};  // FASTQ quality symbols (Phred+33)
 
 struct seqinfo_s
 {
   char * seq;
   unsigned int seqlen;
+  unsigned int record;
+};
+
+struct db_chunk_s
+{
+  char * data;
+  uint64_t size;
 };
 
 struct db_s
@@ -57,8 +46,99 @@ struct db_s
   unsigned int sequences;
   uint64_t nucleotides;
   unsigned int longest;
-  char * datap;
+
+  /*
+    The sequences are stored in chunks of memory that are never moved,
+    each one at least twice as large as the one before, so that
+    stored sequences stay where they are as the data grows. Only the
+    part being read is copied when it does not fit in the rest of a
+    chunk. The chunks are kept and reused for the next batch.
+  */
+  struct db_chunk_s chunks[max_chunks];
+  unsigned int chunkcount;  // chunks allocated
+  unsigned int chunk;       // chunk in use
+  char * datap;             // its data
+  uint64_t chunklen;        // bytes used in it
+  uint64_t partstart;       // where the part being read starts in it
+  uint64_t datalen;         // bytes used in all chunks
   struct seqinfo_s * seqindex {nullptr};
+  uint64_t seqindexalloc;
+
+  /* identifiers of the records started in this batch, if kept,
+     each the first word of the header, terminated by a null */
+  unsigned int records;
+  uint64_t first_record;
+  char * names;
+  uint64_t nameslen;
+  uint64_t namesalloc;
+
+  /* the batch starts with the rest of a record split at the end of
+     the previous batch */
+  bool continued;
+};
+
+struct db_stream_s
+{
+  const char * filename;
+  std::FILE * input_fp;
+  bool is_regular;
+  uint64_t filesize;
+
+  /*
+    Input buffer and position where parsing continues. A regular file
+    is memory mapped and read as one buffer. Other input is read into
+    a buffer in chunks. Compressed input is decompressed on other
+    threads and parsed in the buffers they deliver.
+  */
+  bool is_mapped;
+  char * buffer;       // mapped file or chunk buffer owned by the stream
+  struct decompress_s * decompressor;
+  const char * bufstart;
+  const char * bufp;
+  const char * bufend;
+  uint64_t bufoffset;  // file position of the start of the buffer
+  uint64_t released;   // mapped bytes already given back
+  unsigned int lineno;
+  bool at_line_start;
+
+  /* input format, detected from the first character */
+  enum input_format { format_unknown, format_fasta, format_fastq } format;
+
+  /* part of the record being parsed */
+  enum parse_state { before_header, in_header, in_sequence_lines,
+                     in_plus_line, in_quality } state;
+
+  /* FASTQ quality: minimum accepted symbol, symbols seen so far,
+     and positions of bases below the minimum in this record */
+  unsigned int min_quality_symbol;
+  uint64_t quality_length;
+  unsigned int * lowq;
+  uint64_t lowq_count;
+  uint64_t lowq_alloc;
+  uint64_t * scratch;
+  uint64_t scratch_alloc;
+
+  /* number of nt repeated at the start of the next part
+     when a long sequence is split between batches, and those nt */
+  unsigned int overlap;
+  unsigned char * carry;
+
+  /* keep the record identifiers, and the state of the one being read */
+  bool keep_names;
+  bool name_done;
+
+  /* state of the sequence being read */
+  bool in_sequence;
+  unsigned int record;  // number of the record, modulo 2^32
+  unsigned int length;
+  uint64_t seq_length;
+  uint64_t nt_buffer;
+  unsigned int nt_bufferlen;
+
+  /* statistics for the whole file */
+  uint64_t sequences;
+  uint64_t nucleotides;
+  uint64_t longest;
 };
 
 unsigned int db_getsequencecount(struct db_s * d)
@@ -66,28 +146,161 @@ unsigned int db_getsequencecount(struct db_s * d)
   return d->sequences;
 }
 
-struct db_s * db_read(const char * filename)
+auto db_alloc() -> struct db_s *
 {
   struct db_s * d = (struct db_s *) xmalloc(sizeof(struct db_s));
 
   d->sequences = 0;
   d->nucleotides = 0;
   d->longest = 0;
-  d->datap = nullptr;
+  d->chunks[0].size = memchunk;
+  d->chunks[0].data = static_cast<char *>(xmalloc(memchunk));
+  d->chunkcount = 1;
+  d->chunk = 0;
+  d->datap = d->chunks[0].data;
+  d->chunklen = 0;
+  d->partstart = 0;
+  d->datalen = 0;
   d->seqindex = nullptr;
+  d->seqindexalloc = 0;
+  d->records = 0;
+  d->first_record = 0;
+  d->names = nullptr;
+  d->nameslen = 0;
+  d->namesalloc = 0;
+  d->continued = false;
+
+  return d;
+}
+
+auto db_next_chunk(struct db_s * d, uint64_t size) -> void
+{
+  /*
+    Continue in the next chunk, allocated or enlarged if needed, with
+    room for the part being read and size more bytes. That part is
+    moved there, the sequences before it stay in the chunk.
+  */
+
+  const uint64_t partlen = d->chunklen - d->partstart;
+  const uint64_t needed = partlen + size;
+  const unsigned int next = d->chunk + 1;
+  if (next == max_chunks) {
+    fatal(error_prefix, "Unable to allocate enough memory.");
+  }
+
+  if ((next < d->chunkcount) && (d->chunks[next].size < needed))
+    {
+      /* too small for this part, drop it and the ones after it */
+      for(auto i = next; i < d->chunkcount; i++) {
+        xfree(d->chunks[i].data);
+      }
+      d->chunkcount = next;
+    }
+  if (next == d->chunkcount)
+    {
+      d->chunks[next].size = std::max(2 * d->chunks[d->chunk].size, needed);
+      d->chunks[next].data = static_cast<char *>(xmalloc(d->chunks[next].size));
+      d->chunkcount++;
+    }
+
+  memcpy(d->chunks[next].data, d->datap + d->partstart, partlen);
+  d->chunk = next;
+  d->datap = d->chunks[next].data;
+  d->partstart = 0;
+  d->chunklen = partlen;
+}
+
+inline auto db_reserve(struct db_s * d, uint64_t size) -> void
+{
+  /* make sure there is room for size more bytes of data */
+  if (d->chunklen + size > d->chunks[d->chunk].size) {
+    db_next_chunk(d, size);
+  }
+}
 
-  /* allocate space */
+inline auto db_append(struct db_s * d, const void * src, uint64_t size) -> void
+{
+  db_reserve(d, size);
+  memcpy(d->datap + d->chunklen, src, size);
+  d->chunklen += size;
+  d->datalen += size;
+}
+
+inline auto db_filepos(struct db_stream_s * s) -> uint64_t
+{
+  if (s->decompressor != nullptr) {
+    return decompress_getpos(s->decompressor);  // compressed bytes
+  }
+  return s->bufoffset + static_cast<uint64_t>(s->bufp - s->bufstart);
+}
+
+auto db_fill(struct db_stream_s * s) -> bool
+{
+  /* read more input into the buffer, return false at end of input */
+
+  if (s->is_mapped) {
+    return false;
+  }
+
+  s->bufoffset += static_cast<uint64_t>(s->bufend - s->bufstart);
+
+  if (s->decompressor != nullptr)
+    {
+      const char * data {nullptr};
+      size_t len {0};
+      if (! decompress_next(s->decompressor, & data, & len)) {
+        return false;
+      }
+      s->bufstart = data;
+      s->bufp = data;
+      s->bufend = data + len;
+      return true;
+    }
+
+  const size_t n = fread(s->buffer, 1, inputchunk, s->input_fp);
+  if (ferror(s->input_fp) != 0)
+    {
+      fatal(error_prefix, "Unable to read from input file (", s->filename, ").");
+    }
+  s->bufp = s->buffer;
+  s->bufend = s->buffer + n;
+
+  return n > 0;
+}
+
+auto db_release(struct db_stream_s * s) -> void
+{
+  /* give back the mapped pages already parsed, in large steps */
+
+#ifndef _WIN32
+  if (s->is_mapped)
+    {
+      static const uint64_t page_mask = static_cast<uint64_t>(sysconf(_SC_PAGESIZE)) - 1;
+      const uint64_t done = db_filepos(s) & ~ page_mask;
+      if (done >= s->released + releasechunk)
+        {
+          madvise(s->buffer + s->released, done - s->released, MADV_DONTNEED);
+          s->released = done;
+        }
+    }
+#else
+  (void) s;
+#endif
+}
 
-  uint64_t dataalloc {memchunk};
-  d->datap = static_cast<char *>(xmalloc(dataalloc));
-  uint64_t datalen {0};
+auto db_stream_open(const char * filename,
+                    unsigned int overlap,
+                    unsigned int min_quality) -> struct db_stream_s *
+{
+  auto * s = (struct db_stream_s *) xmalloc(sizeof(struct db_stream_s));
 
   /* open input file or stream */
 
   assert(filename != nullptr);  // filename is set to '-' (stdin) by default
 
-  std::FILE * input_fp { fopen_input(filename) };
-  if (input_fp == nullptr)
+  s->filename = filename;
+  s->input_fp = fopen_input(filename);
+  if (s->input_fp == nullptr)
     {
       fatal(error_prefix, "Unable to open input data file (", filename, ").\n");
     }
@@ -96,222 +309,698 @@ struct db_s * db_read(const char * filename)
 
   struct stat fs;
 
-  if (fstat(fileno(input_fp), & fs) != 0)
+  if (fstat(fileno(s->input_fp), & fs) != 0)
     {
       fatal(error_prefix, "Unable to fstat on input file (", filename, ").\n");
     }
-  bool is_regular = S_ISREG(fs.st_mode);
-  uint64_t filesize = is_regular ? fs.st_size : 0;
-  uint64_t filepos = 0;
+  s->is_regular = S_ISREG(fs.st_mode);
+  s->filesize = s->is_regular ? fs.st_size : 0;
 
-  if (! is_regular)
+  if (! s->is_regular)
     {
       fprintf(logfile, "Waiting for input data...\n");
     }
 
-  size_t linecap = linealloc;
-  char * line {new char[linecap]};
-  ssize_t linelen = xgetline(& line, & linecap, input_fp);
-  if (linelen < 0)
+  nt_encode_init();
+
+  /* look for gzip or zstd compressed input */
+
+  unsigned char magic[decompress_magic_size];
+  const size_t magic_len = fread(magic, 1, decompress_magic_size, s->input_fp);
+  if (ferror(s->input_fp) != 0)
     {
-      line[0] = 0;
-      linelen = 0;
+      fatal(error_prefix, "Unable to read from input file (", filename, ").");
     }
-  filepos += linelen;
+  const decompress_format compression = decompress_detect(magic, magic_len);
 
-  unsigned int lineno {1};
+  /* map regular files into memory, otherwise use a buffer */
 
-  progress_init("Reading sequences:", filesize);
+  s->is_mapped = false;
+  s->buffer = nullptr;
+  s->decompressor = nullptr;
 
-  while(line[0] != 0)
+  if (compression != decompress_none)
     {
-      /* read header */
-      /* the header ends at a space, cr, lf or null character */
+      s->decompressor = decompress_open(s->input_fp, compression,
+                                        reinterpret_cast<char *>(magic),
+                                        magic_len, opt_threads);
+    }
 
-      if (line[0] != '>') {
-        fatal(error_prefix, "Illegal header line in fasta file.");
-      }
+#ifndef _WIN32
+  if ((compression == decompress_none) && s->is_regular && (s->filesize > 0))
+    {
+      void * map = mmap(nullptr, s->filesize, PROT_READ, MAP_PRIVATE,
+                        fileno(s->input_fp), 0);
+      if (map != MAP_FAILED)
+        {
+          madvise(map, s->filesize, MADV_SEQUENTIAL);
+          s->is_mapped = true;
+          s->buffer = static_cast<char *>(map);
+        }
+    }
+#endif
 
+  if (s->is_mapped)
+    {
+      s->bufstart = s->buffer;
+      s->bufend = s->buffer + s->filesize;
+    }
+  else if (s->decompressor != nullptr)
+    {
+      s->bufstart = nullptr;
+      s->bufend = nullptr;
+    }
+  else
+    {
+      /* start with the bytes already read */
+      s->buffer = static_cast<char *>(xmalloc(inputchunk));
+      memcpy(s->buffer, magic, magic_len);
+      s->bufstart = s->buffer;
+      s->bufend = s->buffer + magic_len;
+    }
+  s->bufp = s->bufstart;
+  s->bufoffset = 0;
+  s->released = 0;
+  s->lineno = 1;
+  s->at_line_start = true;
+  s->format = db_stream_s::format_unknown;
+  s->state = db_stream_s::before_header;
+
+  s->min_quality_symbol = (min_quality > 0) ? quality_offset + min_quality : 0;
+  s->quality_length = 0;
+  s->lowq = nullptr;
+  s->lowq_count = 0;
+  s->lowq_alloc = 0;
+  s->scratch = nullptr;
+  s->scratch_alloc = 0;
+
+  s->overlap = overlap;
+  s->carry = static_cast<unsigned char *>(xmalloc(overlap));
+  s->in_sequence = false;
+  s->keep_names = false;
+  s->name_done = true;
+  s->sequences = 0;
+  s->nucleotides = 0;
+  s->longest = 0;
+
+  return s;
+}
 
-      /* store the line number */
+auto db_stream_keepnames(struct db_stream_s * s) -> void
+{
+  s->keep_names = true;
+}
 
-      while (datalen + sizeof(unsigned int) > dataalloc)
-        {
-          dataalloc += memchunk;
-          d->datap = static_cast<char *>(xrealloc(d->datap, dataalloc));
-        }
-      memcpy(d->datap + datalen, & lineno, sizeof(unsigned int));
-      datalen += sizeof(unsigned int);
+auto db_stream_getfilesize(struct db_stream_s * s) -> uint64_t
+{
+  return s->filesize;
+}
 
+auto db_stream_getpos(struct db_stream_s * s) -> uint64_t
+{
+  /* bytes of the file read, compressed bytes for compressed input */
+  return db_filepos(s);
+}
 
-      /* get next line */
+inline auto db_push_nt(struct db_stream_s * s,
+                       struct db_s * d,
+                       uint64_t m) -> void
+{
+  /* add one nucleotide to the sequence being read */
+  static constexpr unsigned int nt_buffersize {4 * sizeof(uint64_t)};
+
+  s->nt_buffer |= m << (2 * s->nt_bufferlen);
+  s->length++;
+  s->nt_bufferlen++;
+
+  if (s->nt_bufferlen == nt_buffersize)
+    {
+      db_append(d, & s->nt_buffer, sizeof(s->nt_buffer));
+      s->nt_bufferlen = 0;
+      s->nt_buffer = 0;
+    }
+}
+
+auto db_start_part(struct db_stream_s * s, struct db_s * d) -> void
+{
+  /* the part starts with the next word */
+
+  d->partstart = d->chunklen;
+  s->length = 0;
+  s->nt_buffer = 0;
+  s->nt_bufferlen = 0;
+}
+
+auto db_end_part(struct db_stream_s * s, struct db_s * d) -> void
+{
+  /* save remaining padded 64-bit value with nt's, if any */
+
+  if (s->nt_bufferlen > 0)
+    {
+      db_append(d, & s->nt_buffer, sizeof(s->nt_buffer));
+      s->nt_buffer = 0;
+      s->nt_bufferlen = 0;
+    }
+
+  /* the part is complete and stays where it is, add it to the index */
+
+  if (d->sequences == d->seqindexalloc)
+    {
+      d->seqindexalloc = std::max(2 * d->seqindexalloc,
+                                  static_cast<uint64_t>(linealloc));
+      d->seqindex = static_cast<struct seqinfo_s *>
+        (xrealloc(d->seqindex, d->seqindexalloc * sizeof(struct seqinfo_s)));
+    }
+  struct seqinfo_s * info = d->seqindex + d->sequences;
+  info->seq = d->datap + d->partstart;
+  info->seqlen = s->length;
+  info->record = s->record;
+
+  d->sequences++;
+  d->nucleotides += s->length;
+  if (s->length > d->longest) {
+    d->longest = s->length;
+  }
+}
+
+auto db_split_part(struct db_stream_s * s, struct db_s * d) -> void
+{
+  /*
+    Replace the current part, holding a whole FASTQ record, by one
+    part for each stretch of bases between the low quality bases.
+    Stretches too short to contain any kmer are dropped.
+  */
+
+  db_end_part(s, d);
+  d->sequences--;
+  d->nucleotides -= s->length;
+
+  const uint64_t words = nt_bytelength(s->length) / sizeof(uint64_t);
+
+  if (words > s->scratch_alloc)
+    {
+      s->scratch_alloc = words;
+      s->scratch = static_cast<uint64_t *>(xrealloc(s->scratch, words * sizeof(uint64_t)));
+    }
+  memcpy(s->scratch, d->datap + d->partstart, words * sizeof(uint64_t));
+  d->datalen -= d->chunklen - d->partstart;
+  d->chunklen = d->partstart;
+
+  auto * seq = reinterpret_cast<char *>(s->scratch);
+  const unsigned int length = s->length;
+  unsigned int from = 0;
+  for(uint64_t i = 0; i <= s->lowq_count; i++)
+    {
+      const unsigned int to = (i < s->lowq_count) ? s->lowq[i] : length;
+      if (to - from > s->overlap)
+        {
+          db_start_part(s, d);
+          for(unsigned int j = from; j < to; j++) {
+            db_push_nt(s, d, nt_extract(seq, j));
+          }
+          db_end_part(s, d);
+        }
+      from = to + 1;
+    }
+}
 
-      linelen = xgetline(& line, & linecap, input_fp);
-      if (linelen < 0)
+auto db_end_sequence(struct db_stream_s * s, struct db_s * d) -> void
+{
+  if (s->format == db_stream_s::format_fasta)
+    {
+      if (s->seq_length == 0)
         {
-          line[0] = 0;
-          linelen = 0;
+          fatal(error_prefix, "Empty sequence found on line ",
+                s->lineno - (s->at_line_start ? 1 : 0), ".");
         }
-      filepos += linelen;
+      db_end_part(s, d);
+    }
+  else if (s->lowq_count == 0)
+    {
+      db_end_part(s, d);
+    }
+  else
+    {
+      db_split_part(s, d);
+    }
 
-      lineno++;
+  s->in_sequence = false;
+  s->state = db_stream_s::before_header;
 
+  s->sequences++;
+  s->nucleotides += s->seq_length;
+  if (s->seq_length > s->longest) {
+    s->longest = s->seq_length;
+  }
 
-      /* store a dummy sequence length */
+  if (s->is_regular) {
+    progress_update(db_filepos(s));
+  }
+}
+
+auto db_scan_quality(struct db_stream_s * s,
+                     const char * p,
+                     const char * end) -> void
+{
+  /* count quality symbols and note bases below the minimum quality */
 
-      unsigned int length {0};
+  static constexpr int carriage_return {13};
 
-      while (datalen + sizeof(unsigned int) > dataalloc)
+  while (p < end)
+    {
+      const auto c = static_cast<unsigned char>(*p++);
+      if (c == carriage_return) {
+        continue;
+      }
+      if (c < s->min_quality_symbol)
         {
-          dataalloc += memchunk;
-          d->datap = static_cast<char *>(xrealloc(d->datap, dataalloc));
+          if (s->lowq_count == s->lowq_alloc)
+            {
+              s->lowq_alloc += linealloc;
+              s->lowq = static_cast<unsigned int *>(xrealloc(s->lowq, s->lowq_alloc * sizeof(unsigned int)));
+            }
+          s->lowq[s->lowq_count++] = static_cast<unsigned int>(s->quality_length);
         }
-      uint64_t datalen_seqlen = datalen;
-      memcpy(d->datap + datalen, & length, sizeof(unsigned int));
-      datalen += sizeof(unsigned int);
-
+      s->quality_length++;
+    }
+}
 
-      /* read and store sequence */
+inline auto db_push_block(struct db_stream_s * s,
+                          struct db_s * d,
+                          uint64_t bits) -> void
+{
+  /* add a block of 32 nucleotides to the sequence being read */
 
-      uint64_t nt_buffer {0};
-      unsigned int nt_bufferlen {0};
-      const unsigned int nt_buffersize {4 * sizeof(nt_buffer)};
-      static constexpr int new_line {10};
-      static constexpr int carriage_return {13};
-      static constexpr int start_chars_range {32};  // visible ascii chars: 32-126
-      static constexpr int end_chars_range {126};
+  if (s->nt_bufferlen == 0)
+    {
+      db_append(d, & bits, sizeof(bits));
+    }
+  else
+    {
+      const uint64_t word = s->nt_buffer | (bits << (2 * s->nt_bufferlen));
+      db_append(d, & word, sizeof(word));
+      s->nt_buffer = bits >> (2 * (nt_encode_blocksize - s->nt_bufferlen));
+    }
+  s->length += nt_encode_blocksize;
+}
 
-      while ((line[0] != 0) && (line[0] != '>'))
+inline auto db_encode(struct db_stream_s * s,
+                      struct db_s * d,
+                      const char * p,
+                      const char * end,
+                      const uint64_t limit) -> const char *
+{
+  /*
+    Encode and store the sequence characters from p up to end, which
+    contains no newlines. Blocks of 32 ordinary nucleotides are
+    encoded with vector instructions, anything else one character at
+    a time. Returns the position where encoding stopped, which is
+    before end only if the batch became full.
+  */
+
+  static constexpr int carriage_return {13};
+  static constexpr int start_chars_range {32};  // visible ascii chars: 32-126
+  static constexpr int end_chars_range {126};
+
+  while (p < end)
+    {
+      uint64_t bits {0};
+      if ((end - p >= nt_encode_blocksize) && nt_encode_block(p, & bits))
+        {
+          db_push_block(s, d, bits);
+          s->seq_length += nt_encode_blocksize;
+          p += nt_encode_blocksize;
+        }
+      else
         {
-          unsigned char c {0};
-          char * pl = line;
-          while((c = static_cast<unsigned char>(*pl++)) != 0U)
+          const char * block_end = std::min(p + nt_encode_blocksize, end);
+          while (p < block_end)
             {
+              const auto c = static_cast<unsigned char>(*p++);
               signed char m {0};
               if ((m = map_nt[static_cast<unsigned int>(c)]) >= 0)
                 {
-                  nt_buffer |= ((static_cast<uint64_t>(m))) << (2 * nt_bufferlen);
-                  length++;
-                  nt_bufferlen++;
-
-                  if (nt_bufferlen == nt_buffersize)
-                    {
-                      while (datalen + sizeof(nt_buffer) > dataalloc)
-                        {
-                          dataalloc += memchunk;
-                          d->datap = static_cast<char *>(xrealloc(d->datap, dataalloc));
-                        }
-
-                      memcpy(d->datap + datalen, & nt_buffer, sizeof(nt_buffer));
-                      datalen += sizeof(nt_buffer);
-
-                      nt_bufferlen = 0;
-                      nt_buffer = 0;
-                    }
+                  db_push_nt(s, d, static_cast<uint64_t>(m));
+                  s->seq_length++;
                 }
-              else if ((c != new_line) && (c != carriage_return))
+              else if (c != carriage_return)
                 {
                   if ((c >= start_chars_range) && (c <= end_chars_range)) {
                     fatal(error_prefix, "Illegal character '", static_cast<char>(c),
-                          "' in sequence on line ", lineno, ".");
+                          "' in sequence on line ", s->lineno, ".");
                   }
                   else {
-                    fatal(error_prefix, "Illegal character (ascii no ", static_cast<char>(c),
-                          ") in sequence on line ", lineno, ".");
+                    fatal(error_prefix, "Illegal character (ascii no ",
+                          static_cast<unsigned int>(c),
+                          ") in sequence on line ", s->lineno, ".");
                   }
                 }
             }
+        }
 
-          linelen = xgetline(& line, & linecap, input_fp);
-          if (linelen < 0)
-            {
-              line[0] = 0;
-              linelen = 0;
-            }
-          filepos += linelen;
-
-          lineno++;
+      if ((limit > 0) && (d->datalen >= limit) &&
+          (s->length > s->overlap))
+        {
+          break;
         }
+    }
 
-      /* fill in real length */
+  return p;
+}
 
-      memcpy(d->datap + datalen_seqlen, & length, sizeof(unsigned int));
+auto db_add_name(struct db_stream_s * s,
+                 struct db_s * d,
+                 const char * end,
+                 bool at_eol) -> void
+{
+  /* add the header up to the first blank to the record identifiers,
+     the header line may continue in the next buffer */
 
-      if (length == 0)
-        {
-          fatal(error_prefix, "Empty sequence found on line ", lineno - 1, ".");
-        }
+  const char * p = s->bufp;
+  while ((p < end) && (*p != ' ') && (*p != '\t') && (*p != '\r')) {
+    p++;
+  }
+  const auto len = static_cast<uint64_t>(p - s->bufp);
+  const bool done = (p < end) || at_eol;
 
-      d->nucleotides += length;
+  if (d->nameslen + len + 1 > d->namesalloc)
+    {
+      d->namesalloc = std::max(2 * d->namesalloc, d->nameslen + len + 1 + linealloc);
+      d->names = static_cast<char *>(xrealloc(d->names, d->namesalloc));
+    }
+  memcpy(d->names + d->nameslen, s->bufp, len);
+  d->nameslen += len;
+  if (done)
+    {
+      d->names[d->nameslen++] = 0;
+      s->name_done = true;
+    }
+}
 
-      if (length > d->longest) {
-        d->longest = length;
-      }
+auto db_parse(struct db_stream_s * s,
+              struct db_s * d,
+              const uint64_t limit) -> bool
+{
+  /*
+    Parse FASTA or FASTQ sequences from the stream and add them to d.
+    With a non-zero limit, stop as soon as the data exceeds limit
+    bytes, if necessary in the middle of a sequence. That sequence then
+    continues in the next batch, starting with the last overlap
+    nucleotides already stored. FASTQ records are never split when
+    filtering on quality, as the quality comes after the sequence.
+    Returns true if anything was added.
+  */
+
+  static constexpr int new_line {10};
+  static constexpr int carriage_return {13};
+
+  const unsigned int sequences_before = d->sequences;
+  const unsigned int records_before = d->records;
+
+  if (s->in_sequence && (s->state == db_stream_s::in_sequence_lines))
+    {
+      /* continue a sequence split at the end of the previous batch */
 
+      d->continued = true;
+      db_start_part(s, d);
+      for(auto i = 0U; i < s->overlap; i++) {
+        db_push_nt(s, d, s->carry[i]);
+      }
+    }
 
-      /* save remaining padded 64-bit value with nt's, if any */
+  while ((s->bufp < s->bufend) || db_fill(s))
+    {
+      const auto rest = static_cast<size_t>(s->bufend - s->bufp);
+      const auto * eol = static_cast<const char *>(memchr(s->bufp, new_line, rest));
+      const char * end = (eol != nullptr) ? eol : s->bufend;
 
-      if (nt_bufferlen > 0)
+      switch (s->state)
         {
-          while (datalen + sizeof(nt_buffer) > dataalloc)
-            {
-              dataalloc += memchunk;
-              d->datap = static_cast<char *>(xrealloc(d->datap, dataalloc));
+        case db_stream_s::before_header:
+          {
+            /* start new record, detecting the format at the first one */
+
+            const char c = *s->bufp;
+
+            if ((s->format == db_stream_s::format_fastq) &&
+                ((c == new_line) || (c == carriage_return)))
+              {
+                /* skip empty lines between fastq records */
+                s->bufp++;
+                if (c == new_line) {
+                  s->lineno++;
+                }
+                continue;
+              }
+
+            if (s->format == db_stream_s::format_unknown) {
+              s->format = (c == '@') ? db_stream_s::format_fastq : db_stream_s::format_fasta;
             }
 
-          memcpy(d->datap + datalen, & nt_buffer, sizeof(nt_buffer));
-          datalen += sizeof(nt_buffer);
+            if (s->format == db_stream_s::format_fasta)
+              {
+                if (c != '>') {
+                  fatal(error_prefix, "Illegal header line in fasta file.");
+                }
+              }
+            else
+              {
+                if (c != '@') {
+                  fatal(error_prefix, "Illegal header line in fastq file",
+                        " on line ", s->lineno, ".");
+                }
+              }
 
-          nt_buffer = 0;
-          nt_bufferlen = 0;  // that value is never read again, all tests pass without it
-        }
+            s->record = static_cast<unsigned int>(s->sequences);
+            if (s->keep_names)
+              {
+                if (d->records == 0) {
+                  d->first_record = s->sequences;
+                }
+                d->records++;
+                s->name_done = false;
+              }
+            db_start_part(s, d);
+            s->seq_length = 0;
+            s->quality_length = 0;
+            s->lowq_count = 0;
+            s->in_sequence = true;
+            s->state = db_stream_s::in_header;
+            s->at_line_start = false;
+            s->bufp++;
+            continue;
+          }
+
+        case db_stream_s::in_header:
+        case db_stream_s::in_plus_line:
+          {
+            if ((s->state == db_stream_s::in_header) && s->keep_names &&
+                ! s->name_done)
+              {
+                db_add_name(s, d, end, eol != nullptr);
+              }
+
+            /* skip rest of line */
+
+            if (eol == nullptr)
+              {
+                s->bufp = s->bufend;
+                continue;
+              }
+            s->bufp = eol + 1;
+            s->lineno++;
+            s->at_line_start = true;
+            s->state = (s->state == db_stream_s::in_header) ?
+              db_stream_s::in_sequence_lines : db_stream_s::in_quality;
+            continue;
+          }
+
+        case db_stream_s::in_quality:
+          {
+            /* skip quality symbols, checking them only if needed */
+
+            if ((eol != nullptr) && (s->min_quality_symbol == 0))
+              {
+                s->quality_length += static_cast<uint64_t>(eol - s->bufp);
+                if ((eol > s->bufp) && (*(eol - 1) == carriage_return)) {
+                  s->quality_length--;
+                }
+              }
+            else
+              {
+                db_scan_quality(s, s->bufp, end);
+              }
+
+            if (eol == nullptr)
+              {
+                s->bufp = s->bufend;
+                continue;
+              }
+
+            if (s->quality_length > s->seq_length)
+              {
+                fatal(error_prefix, "Quality string longer than sequence",
+                      " on line ", s->lineno, ".");
+              }
+
+            s->bufp = eol + 1;
+            s->lineno++;
+            s->at_line_start = true;
+
+            /* record ends when all quality symbols have been seen */
+
+            if (s->quality_length == s->seq_length)
+              {
+                db_end_sequence(s, d);
+                if ((limit > 0) && (d->datalen >= limit)) {
+                  break;
+                }
+              }
+            continue;
+          }
+
+        case db_stream_s::in_sequence_lines:
+          {
+            if (s->at_line_start)
+              {
+                const char c = *s->bufp;
+
+                if ((s->format == db_stream_s::format_fasta) && (c == '>'))
+                  {
+                    /* end sequence, stop here if batch is full */
+
+                    db_end_sequence(s, d);
+                    if ((limit > 0) && (d->datalen >= limit)) {
+                      break;
+                    }
+                    continue;
+                  }
 
-      d->sequences++;
+                if ((s->format == db_stream_s::format_fastq) && (c == '+'))
+                  {
+                    s->state = db_stream_s::in_plus_line;
+                    s->bufp++;
+                    continue;
+                  }
+              }
 
-      if (is_regular) {
-        progress_update(filepos);
-      }
-    }
-  progress_done();
+            /* read and store sequence up to end of line */
 
-  fclose(input_fp);
+            const bool may_split = (s->format == db_stream_s::format_fasta) ||
+              (s->min_quality_symbol == 0);
+            s->at_line_start = false;
+            s->bufp = db_encode(s, d, s->bufp, end, may_split ? limit : 0);
 
+            if (s->bufp < end)
+              {
+                /* batch is full, split sequence and keep its last nt */
 
-  /* create indices */
+                const unsigned int length = s->length;
+                db_end_part(s, d);
+                char * seq = d->datap + d->partstart;
+                for(auto i = 0U; i < s->overlap; i++) {
+                  s->carry[i] = nt_extract(seq, length - s->overlap + i);
+                }
+                return true;
+              }
+
+            if (eol != nullptr)
+              {
+                s->bufp = eol + 1;
+                s->lineno++;
+                s->at_line_start = true;
+              }
+            continue;
+          }
+        }
 
-  d->seqindex = (struct seqinfo_s *) xmalloc(d->sequences * sizeof(struct seqinfo_s));
-  struct seqinfo_s * seqindex_p = d->seqindex;
+      /* only reached when the batch is full at the end of a record */
+      break;
+    }
+
+  /* end of input, or batch full at the start of a new record */
 
-  char * pl = d->datap;
-  progress_init("Indexing database:", d->sequences);
-  for(auto i = 0ULL; i < d->sequences; i++)
+  if (s->in_sequence)
     {
-      /* get line number */
-      pl += sizeof(unsigned int);
-
-      /* and sequence */
-      unsigned int seqlen = *(reinterpret_cast<unsigned int*>(pl));
-      seqindex_p->seqlen = seqlen;
-      pl += sizeof(unsigned int);
-      seqindex_p->seq = pl;
-      pl += nt_bytelength(seqlen);
-
-      seqindex_p++;
-      progress_update(i);
+      if ((s->format == db_stream_s::format_fastq) &&
+          ((s->state != db_stream_s::in_quality) ||
+           (s->quality_length != s->seq_length)))
+        {
+          fatal(error_prefix, "Incomplete fastq record at end of file.");
+        }
+      db_end_sequence(s, d);
     }
-  progress_done();
 
-  delete [] line;
-  line = nullptr;
-  linecap = 0;
+  return (d->sequences > sequences_before) || (d->records > records_before);
+}
 
-  fprintf(logfile, "Database info:     %" PRIu64 " nt", d->nucleotides);
-  fprintf(logfile, " in %u sequences,", d->sequences);
-  fprintf(logfile, " longest %u nt\n", d->longest);
+auto db_showinfo(uint64_t nucleotides,
+                 uint64_t sequences,
+                 uint64_t longest) -> void
+{
+  fprintf(logfile, "Database info:     %" PRIu64 " nt", nucleotides);
+  fprintf(logfile, " in %" PRIu64 " sequences,", sequences);
+  fprintf(logfile, " longest %" PRIu64 " nt\n", longest);
+}
 
-  return d;
+auto db_stream_next(struct db_stream_s * s,
+                    struct db_s * d,
+                    uint64_t limit) -> bool
+{
+  /* replace the contents of d with the next batch of sequences */
+
+  d->sequences = 0;
+  d->nucleotides = 0;
+  d->longest = 0;
+  d->chunk = 0;
+  d->datap = d->chunks[0].data;
+  d->chunklen = 0;
+  d->partstart = 0;
+  d->datalen = 0;
+  d->records = 0;
+  d->nameslen = 0;
+  d->continued = false;
+
+  if (! db_parse(s, d, limit)) {
+    return false;
+  }
+
+  db_release(s);
+  return true;
 }
 
+auto db_stream_close(struct db_stream_s * s) -> void
+{
+  if (s->decompressor != nullptr) {
+    decompress_close(s->decompressor);
+  }
+#ifndef _WIN32
+  if (s->is_mapped) {
+    munmap(s->buffer, s->filesize);
+  }
+  else if (s->buffer != nullptr) {
+    xfree(s->buffer);
+  }
+#else
+  if (s->buffer != nullptr) {
+    xfree(s->buffer);
+  }
+#endif
+  fclose(s->input_fp);
+  xfree(s->carry);
+  if (s->lowq != nullptr) {
+    xfree(s->lowq);
+  }
+  if (s->scratch != nullptr) {
+    xfree(s->scratch);
+  }
+  xfree(s);
+}
+
+auto db_stream_showinfo(struct db_stream_s * s) -> void
+{
+  db_showinfo(s->nucleotides, s->sequences, s->longest);
+}
 
 void db_getsequenceandlength(struct db_s * d,
 			     uint64_t seqno,
@@ -322,19 +1011,44 @@ void db_getsequenceandlength(struct db_s * d,
   *length = d->seqindex[seqno].seqlen;
 }
 
-uint64_t db_getnucleotides(struct db_s * d)
+auto db_getrecord(struct db_s * d, uint64_t seqno) -> unsigned int
 {
-  return d->nucleotides;
+  return d->seqindex[seqno].record;
 }
 
+auto db_getrecordcount(struct db_s * d) -> unsigned int
+{
+  return d->records;
+}
+
+auto db_getfirstrecord(struct db_s * d) -> uint64_t
+{
+  return d->first_record;
+}
+
+auto db_getcontinued(struct db_s * d) -> bool
+{
+  return d->continued;
+}
+
+auto db_getnames(struct db_s * d) -> const char *
+{
+  return d->names;
+}
 
 void db_free(struct db_s * d)
 {
-  if (d->datap)
-    xfree(d->datap);
+  for(auto i = 0U; i < d->chunkcount; i++)
+    xfree(d->chunks[i].data);
   d->datap = nullptr;
 
   if (d->seqindex)
     xfree(d->seqindex);
   d->seqindex = nullptr;
+
+  if (d->names)
+    xfree(d->names);
+  d->names = nullptr;
+
+  xfree(d);
 }
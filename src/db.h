@@ -19,15 +19,46 @@
     PO Box 1080 Blindern, NO-0316 Oslo, Norway
 */
 
-struct db_s * db_read(const char * filename);
+auto db_alloc() -> struct db_s *;
 
 unsigned int db_getsequencecount(struct db_s * d);
 
-uint64_t db_getnucleotides(struct db_s * d);
-
 void db_getsequenceandlength(struct db_s * d,
 			     uint64_t seqno,
                              char ** address,
                              unsigned int * length);
 
 void db_free(struct db_s * d);
+
+/* the records of a batch (parts of the same record have the same
+   record number), with their identifiers if kept by the stream */
+
+auto db_getrecord(struct db_s * d, uint64_t seqno) -> unsigned int;
+
+auto db_getrecordcount(struct db_s * d) -> unsigned int;
+
+auto db_getfirstrecord(struct db_s * d) -> uint64_t;
+
+auto db_getcontinued(struct db_s * d) -> bool;
+
+auto db_getnames(struct db_s * d) -> const char *;
+
+/* streaming interface, reading the sequences in batches */
+
+auto db_stream_open(const char * filename,
+                    unsigned int overlap,
+                    unsigned int min_quality) -> struct db_stream_s *;
+
+auto db_stream_keepnames(struct db_stream_s * s) -> void;
+
+auto db_stream_getfilesize(struct db_stream_s * s) -> uint64_t;
+
+auto db_stream_getpos(struct db_stream_s * s) -> uint64_t;
+
+auto db_stream_next(struct db_stream_s * s,
+                    struct db_s * d,
+                    uint64_t limit) -> bool;
+
+auto db_stream_showinfo(struct db_stream_s * s) -> void;
+
+auto db_stream_close(struct db_stream_s * s) -> void;
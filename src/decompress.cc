@@ -0,0 +1,713 @@
+/*
+    Copyright (C) 2012-2023 Torbjorn Rognes and Frederic Mahe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Torbjorn Rognes <torognes@ifi.uio.no>,
+    Department of Informatics, University of Oslo,
+    PO Box 1080 Blindern, NO-0316 Oslo, Norway
+*/
+
+#include "main.h"
+#include <zlib.h>  // only types and constants, the library is loaded at run time
+
+
+/* zstd stable API declarations, the library is loaded at run time */
+
+struct zstd_dctx_s;
+
+struct zstd_inbuffer_s
+{
+  const void * src;
+  size_t size;
+  size_t pos;
+};
+
+struct zstd_outbuffer_s
+{
+  void * dst;
+  size_t size;
+  size_t pos;
+};
+
+
+#ifdef _WIN32
+static const char * const zlib_names[] = { "zlib1.dll", nullptr };
+static const char * const zstd_names[] = { "libzstd.dll", nullptr };
+#elif defined __APPLE__
+static const char * const zlib_names[] = { "libz.dylib", nullptr };
+static const char * const zstd_names[] = { "libzstd.dylib", "libzstd.1.dylib", nullptr };
+#else
+static const char * const zlib_names[] = { "libz.so.1", "libz.so", nullptr };
+static const char * const zstd_names[] = { "libzstd.so.1", "libzstd.so", nullptr };
+#endif
+
+static int (*inflateInit2_p)(z_stream *, int, const char *, int);
+static int (*inflate_p)(z_stream *, int);
+static int (*inflateReset_p)(z_stream *);
+static int (*inflateEnd_p)(z_stream *);
+
+static zstd_dctx_s * (*zstd_createDCtx_p)();
+static size_t (*zstd_freeDCtx_p)(zstd_dctx_s *);
+static size_t (*zstd_decompressStream_p)(zstd_dctx_s *, zstd_outbuffer_s *, zstd_inbuffer_s *);
+static unsigned int (*zstd_isError_p)(size_t);
+static const char * (*zstd_getErrorName_p)(size_t);
+
+constexpr size_t out_chunk {1 << 20};   // decompressed bytes per buffer
+constexpr size_t in_chunk {1 << 18};    // compressed bytes read at a time
+constexpr size_t bgzf_group {1 << 18};  // compressed BGZF bytes per buffer
+constexpr unsigned int gzip_window {15};
+constexpr unsigned int gzip_auto {32};  // add to window: detect gzip or zlib
+constexpr unsigned int gzip_only {16};  // add to window: gzip only
+
+enum slot_state { slot_free, slot_filled, slot_working, slot_ready };
+
+struct decompress_slot_s
+{
+  char * in;           // compressed BGZF blocks
+  size_t in_len;
+  size_t in_alloc;
+  char * out;          // decompressed data
+  size_t out_len;
+  size_t out_alloc;
+  uint64_t in_pos;     // compressed bytes read up to the end of this buffer
+  bool last;           // empty buffer marking the end of the input
+  slot_state state;
+};
+
+struct decompress_s
+{
+  decompress_format format;
+  std::FILE * fp;
+  char * prefix;       // bytes already read from fp by the caller
+  size_t prefix_len;
+  size_t prefix_pos;
+  uint64_t in_pos;     // compressed bytes read so far
+  uint64_t out_pos;    // compressed position of the buffer delivered last
+
+  struct decompress_slot_s * slots;
+  uint64_t slot_count;
+  uint64_t head;       // number of buffers started by the reader
+  uint64_t tail;       // number of buffers delivered to the consumer
+  bool holding;        // consumer holds buffer tail - 1
+  bool eof;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t reader;
+  pthread_t * workers;
+  int64_t worker_count;
+  bool quit;
+};
+
+
+template <typename F>
+auto decompress_sym(void * lib, const char * name, F * f) -> void
+{
+  * f = reinterpret_cast<F>(arch_dlsym(lib, name));
+  if (* f == nullptr) {
+    fatal(error_prefix, "Symbol ", name, " not found in compression library.");
+  }
+}
+
+auto decompress_load(const char * const * names, const char * what) -> void *
+{
+  for(auto i = 0U; names[i] != nullptr; i++)
+    {
+      void * lib = arch_dlopen(names[i]);
+      if (lib != nullptr) {
+        return lib;
+      }
+    }
+  fatal(error_prefix, "Unable to load the ", what, " library needed to read ",
+        what, " compressed input.");
+  return nullptr;
+}
+
+auto decompress_load_zlib() -> void
+{
+  static void * lib {nullptr};
+  if (lib != nullptr) {
+    return;
+  }
+  lib = decompress_load(zlib_names, "zlib");
+  decompress_sym(lib, "inflateInit2_", & inflateInit2_p);
+  decompress_sym(lib, "inflate", & inflate_p);
+  decompress_sym(lib, "inflateReset", & inflateReset_p);
+  decompress_sym(lib, "inflateEnd", & inflateEnd_p);
+}
+
+auto decompress_load_zstd() -> void
+{
+  static void * lib {nullptr};
+  if (lib != nullptr) {
+    return;
+  }
+  lib = decompress_load(zstd_names, "zstd");
+  decompress_sym(lib, "ZSTD_createDCtx", & zstd_createDCtx_p);
+  decompress_sym(lib, "ZSTD_freeDCtx", & zstd_freeDCtx_p);
+  decompress_sym(lib, "ZSTD_decompressStream", & zstd_decompressStream_p);
+  decompress_sym(lib, "ZSTD_isError", & zstd_isError_p);
+  decompress_sym(lib, "ZSTD_getErrorName", & zstd_getErrorName_p);
+}
+
+
+auto decompress_detect(const unsigned char * magic, size_t len) -> decompress_format
+{
+  /* recognize compressed data by its first bytes */
+
+  static constexpr unsigned char gzip_id1 {0x1f};
+  static constexpr unsigned char gzip_id2 {0x8b};
+  static constexpr unsigned char gzip_fextra {0x04};
+  static constexpr unsigned char zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+  if ((len >= 2) && (magic[0] == gzip_id1) && (magic[1] == gzip_id2))
+    {
+      /* BGZF: gzip with an extra field whose first subfield is BC */
+      if ((len >= decompress_magic_size) && ((magic[3] & gzip_fextra) != 0) &&
+          (magic[12] == 'B') && (magic[13] == 'C')) {
+        return decompress_bgzf;
+      }
+      return decompress_gzip;
+    }
+
+  if ((len >= sizeof(zstd_magic)) &&
+      (memcmp(magic, zstd_magic, sizeof(zstd_magic)) == 0)) {
+    return decompress_zstd;
+  }
+
+  return decompress_none;
+}
+
+
+auto decompress_read(struct decompress_s * z, char * buf, size_t len) -> size_t
+{
+  /* read compressed data, starting with the bytes read by the caller */
+
+  size_t n = std::min(len, z->prefix_len - z->prefix_pos);
+  memcpy(buf, z->prefix + z->prefix_pos, n);
+  z->prefix_pos += n;
+
+  while (n < len)
+    {
+      const size_t r = fread(buf + n, 1, len - n, z->fp);
+      if (ferror(z->fp) != 0) {
+        fatal(error_prefix, "Unable to read compressed input.");
+      }
+      if (r == 0) {
+        break;
+      }
+      n += r;
+    }
+
+  z->in_pos += n;
+  return n;
+}
+
+
+auto decompress_slot_get(struct decompress_s * z) -> struct decompress_slot_s *
+{
+  /* wait for the next buffer in the ring to become free */
+
+  struct decompress_slot_s * slot = z->slots + (z->head % z->slot_count);
+  pthread_mutex_lock(& z->mutex);
+  while ((slot->state != slot_free) && ! z->quit) {
+    pthread_cond_wait(& z->cond, & z->mutex);
+  }
+  pthread_mutex_unlock(& z->mutex);
+  return z->quit ? nullptr : slot;
+}
+
+auto decompress_slot_post(struct decompress_s * z,
+                          struct decompress_slot_s * slot,
+                          slot_state state) -> void
+{
+  pthread_mutex_lock(& z->mutex);
+  slot->in_pos = z->in_pos;
+  slot->state = state;
+  z->head++;
+  pthread_cond_broadcast(& z->cond);
+  pthread_mutex_unlock(& z->mutex);
+}
+
+auto decompress_post_end(struct decompress_s * z) -> void
+{
+  struct decompress_slot_s * slot = decompress_slot_get(z);
+  if (slot != nullptr)
+    {
+      slot->out_len = 0;
+      slot->last = true;
+      decompress_slot_post(z, slot, slot_ready);
+    }
+}
+
+
+auto decompress_gzip_stream(struct decompress_s * z) -> void
+{
+  /* decompress gzip data, possibly with several members, in order */
+
+  z_stream strm;
+  memset(& strm, 0, sizeof(strm));
+  if (inflateInit2_p(& strm, gzip_window + gzip_auto, ZLIB_VERSION,
+                     static_cast<int>(sizeof(z_stream))) != Z_OK) {
+    fatal(error_prefix, "Unable to initialize gzip decompression.");
+  }
+
+  auto * inbuf = static_cast<char *>(xmalloc(in_chunk));
+  bool member_end {false};  // at the end of a gzip member
+  bool eof {false};
+
+  while (! eof)
+    {
+      struct decompress_slot_s * slot = decompress_slot_get(z);
+      if (slot == nullptr) {
+        break;
+      }
+      slot->out_len = 0;
+      slot->last = false;
+
+      while (slot->out_len < slot->out_alloc)
+        {
+          if (strm.avail_in == 0)
+            {
+              const size_t n = decompress_read(z, inbuf, in_chunk);
+              if (n == 0)
+                {
+                  eof = true;
+                  break;
+                }
+              strm.next_in = reinterpret_cast<Bytef *>(inbuf);
+              strm.avail_in = static_cast<uInt>(n);
+            }
+
+          strm.next_out = reinterpret_cast<Bytef *>(slot->out + slot->out_len);
+          strm.avail_out = static_cast<uInt>(slot->out_alloc - slot->out_len);
+          const int ret = inflate_p(& strm, Z_NO_FLUSH);
+          const bool progress = (strm.avail_out < slot->out_alloc - slot->out_len);
+          slot->out_len = slot->out_alloc - strm.avail_out;
+
+          if (ret == Z_STREAM_END)
+            {
+              /* another member may follow */
+              member_end = true;
+              inflateReset_p(& strm);
+            }
+          else if ((ret == Z_OK) || (ret == Z_BUF_ERROR))
+            {
+              if (progress) {
+                member_end = false;
+              }
+            }
+          else if (member_end && ! progress)
+            {
+              /* ignore trailing garbage after the last member */
+              eof = true;
+              break;
+            }
+          else
+            {
+              fatal(error_prefix, "Unable to decompress gzip input (",
+                    (strm.msg != nullptr) ? strm.msg : "data error", ").");
+            }
+        }
+
+      if (eof && ! member_end && (z->in_pos > 0)) {
+        fatal(error_prefix, "Unexpected end of gzip compressed input.");
+      }
+
+      if (slot->out_len > 0) {
+        decompress_slot_post(z, slot, slot_ready);
+      }
+    }
+
+  inflateEnd_p(& strm);
+  xfree(inbuf);
+}
+
+
+auto decompress_zstd_stream(struct decompress_s * z) -> void
+{
+  /* decompress zstd data, possibly with several frames, in order */
+
+  zstd_dctx_s * dctx = zstd_createDCtx_p();
+  if (dctx == nullptr) {
+    fatal(error_prefix, "Unable to initialize zstd decompression.");
+  }
+
+  auto * inbuf = static_cast<char *>(xmalloc(in_chunk));
+  zstd_inbuffer_s input {inbuf, 0, 0};
+  size_t ret {0};  // zero at the end of a frame
+  bool eof {false};
+
+  while (! eof)
+    {
+      struct decompress_slot_s * slot = decompress_slot_get(z);
+      if (slot == nullptr) {
+        break;
+      }
+      slot->last = false;
+      zstd_outbuffer_s output {slot->out, slot->out_alloc, 0};
+
+      while (output.pos < output.size)
+        {
+          if (input.pos == input.size)
+            {
+              const size_t n = decompress_read(z, inbuf, in_chunk);
+              if (n == 0)
+                {
+                  eof = true;
+                  break;
+                }
+              input.size = n;
+              input.pos = 0;
+            }
+
+          ret = zstd_decompressStream_p(dctx, & output, & input);
+          if (zstd_isError_p(ret) != 0U) {
+            fatal(error_prefix, "Unable to decompress zstd input (",
+                  zstd_getErrorName_p(ret), ").");
+          }
+        }
+
+      if (eof && (ret != 0)) {
+        fatal(error_prefix, "Unexpected end of zstd compressed input.");
+      }
+
+      slot->out_len = output.pos;
+      if (slot->out_len > 0) {
+        decompress_slot_post(z, slot, slot_ready);
+      }
+    }
+
+  zstd_freeDCtx_p(dctx);
+  xfree(inbuf);
+}
+
+
+auto bgzf_uint16(const char * p) -> unsigned int
+{
+  const auto * u = reinterpret_cast<const unsigned char *>(p);
+  return u[0] | (static_cast<unsigned int>(u[1]) << 8U);
+}
+
+auto bgzf_uint32(const char * p) -> uint64_t
+{
+  return bgzf_uint16(p) | (static_cast<uint64_t>(bgzf_uint16(p + 2)) << 16U);
+}
+
+auto decompress_bgzf_read(struct decompress_s * z) -> void
+{
+  /*
+    Read groups of whole BGZF blocks into the buffers, leaving the
+    decompression to the worker threads. Each block starts with a
+    gzip header holding its total size, and ends with the size of the
+    decompressed data.
+  */
+
+  static constexpr unsigned int bsize_offset {16};
+  static constexpr unsigned int isize_size {4};
+
+  bool eof {false};
+
+  while (! eof)
+    {
+      struct decompress_slot_s * slot = decompress_slot_get(z);
+      if (slot == nullptr) {
+        return;
+      }
+      slot->in_len = 0;
+      slot->out_len = 0;
+      slot->last = false;
+      size_t out_size {0};
+
+      while (slot->in_len < bgzf_group)
+        {
+          if (slot->in_len + UINT16_MAX + 1 > slot->in_alloc)
+            {
+              slot->in_alloc = slot->in_len + UINT16_MAX + 1;
+              slot->in = static_cast<char *>(xrealloc(slot->in, slot->in_alloc));
+            }
+
+          char * block = slot->in + slot->in_len;
+          const size_t n = decompress_read(z, block, decompress_magic_size);
+          if (n == 0)
+            {
+              eof = true;
+              break;
+            }
+          if ((n < decompress_magic_size) ||
+              (decompress_detect(reinterpret_cast<unsigned char *>(block), n) != decompress_bgzf)) {
+            fatal(error_prefix, "Invalid BGZF block in compressed input.");
+          }
+
+          const size_t block_size = bgzf_uint16(block + bsize_offset) + 1;
+          if ((block_size < decompress_magic_size + isize_size) ||
+              (decompress_read(z, block + n, block_size - n) != block_size - n)) {
+            fatal(error_prefix, "Unexpected end of BGZF compressed input.");
+          }
+
+          out_size += bgzf_uint32(block + block_size - isize_size);
+          slot->in_len += block_size;
+        }
+
+      if (out_size > slot->out_alloc)
+        {
+          slot->out_alloc = out_size;
+          slot->out = static_cast<char *>(xrealloc(slot->out, slot->out_alloc));
+        }
+
+      if (slot->in_len > 0) {
+        decompress_slot_post(z, slot, slot_filled);
+      }
+    }
+}
+
+auto decompress_bgzf_slot(struct decompress_slot_s * slot) -> void
+{
+  /* decompress all BGZF blocks in a buffer, one gzip member each */
+
+  z_stream strm;
+  memset(& strm, 0, sizeof(strm));
+  if (inflateInit2_p(& strm, gzip_window + gzip_only, ZLIB_VERSION,
+                     static_cast<int>(sizeof(z_stream))) != Z_OK) {
+    fatal(error_prefix, "Unable to initialize gzip decompression.");
+  }
+
+  strm.next_in = reinterpret_cast<Bytef *>(slot->in);
+  strm.avail_in = static_cast<uInt>(slot->in_len);
+  strm.next_out = reinterpret_cast<Bytef *>(slot->out);
+  strm.avail_out = static_cast<uInt>(slot->out_alloc);
+
+  while (strm.avail_in > 0)
+    {
+      const int ret = inflate_p(& strm, Z_FINISH);
+      if (ret == Z_STREAM_END) {
+        inflateReset_p(& strm);
+      }
+      else {
+        fatal(error_prefix, "Unable to decompress BGZF input (",
+              (strm.msg != nullptr) ? strm.msg : "data error", ").");
+      }
+    }
+
+  slot->out_len = slot->out_alloc - strm.avail_out;
+  inflateEnd_p(& strm);
+}
+
+auto decompress_worker(void * vp) -> void *
+{
+  /* decompress BGZF buffers read by the reader thread */
+
+  auto * z = static_cast<struct decompress_s *>(vp);
+
+  pthread_mutex_lock(& z->mutex);
+  while (! z->quit)
+    {
+      struct decompress_slot_s * slot {nullptr};
+      for(uint64_t i = z->tail; (i < z->head) && (slot == nullptr); i++)
+        {
+          struct decompress_slot_s * s = z->slots + (i % z->slot_count);
+          if (s->state == slot_filled) {
+            slot = s;
+          }
+        }
+
+      if (slot == nullptr)
+        {
+          pthread_cond_wait(& z->cond, & z->mutex);
+          continue;
+        }
+
+      slot->state = slot_working;
+      pthread_mutex_unlock(& z->mutex);
+      decompress_bgzf_slot(slot);
+      pthread_mutex_lock(& z->mutex);
+      slot->state = slot_ready;
+      pthread_cond_broadcast(& z->cond);
+    }
+  pthread_mutex_unlock(& z->mutex);
+
+  return nullptr;
+}
+
+auto decompress_reader(void * vp) -> void *
+{
+  auto * z = static_cast<struct decompress_s *>(vp);
+
+  switch (z->format)
+    {
+    case decompress_gzip:
+      decompress_gzip_stream(z);
+      break;
+    case decompress_bgzf:
+      decompress_bgzf_read(z);
+      break;
+    case decompress_zstd:
+      decompress_zstd_stream(z);
+      break;
+    case decompress_none:
+      break;
+    }
+
+  decompress_post_end(z);
+
+  return nullptr;
+}
+
+
+auto decompress_open(std::FILE * fp,
+                     decompress_format format,
+                     const char * prefix,
+                     size_t prefix_len,
+                     int64_t threads) -> struct decompress_s *
+{
+  if (format == decompress_zstd) {
+    decompress_load_zstd();
+  }
+  else {
+    decompress_load_zlib();
+  }
+
+  auto * z = static_cast<struct decompress_s *>(xmalloc(sizeof(struct decompress_s)));
+
+  z->format = format;
+  z->fp = fp;
+  z->prefix = static_cast<char *>(xmalloc(prefix_len));
+  memcpy(z->prefix, prefix, prefix_len);
+  z->prefix_len = prefix_len;
+  z->prefix_pos = 0;
+  z->in_pos = 0;
+  z->out_pos = 0;
+
+  /* BGZF blocks are decompressed in parallel by the worker threads */
+
+  z->worker_count = (format == decompress_bgzf) ? threads : 0;
+  z->slot_count = 4 + 2 * static_cast<uint64_t>(z->worker_count);
+  z->slots = static_cast<struct decompress_slot_s *>
+    (xmalloc(z->slot_count * sizeof(struct decompress_slot_s)));
+  for(uint64_t i = 0; i < z->slot_count; i++)
+    {
+      struct decompress_slot_s * slot = z->slots + i;
+      slot->in = nullptr;
+      slot->in_len = 0;
+      slot->in_alloc = 0;
+      slot->out_alloc = (format == decompress_bgzf) ? 0 : out_chunk;
+      slot->out = (format == decompress_bgzf) ? nullptr :
+        static_cast<char *>(xmalloc(slot->out_alloc));
+      slot->out_len = 0;
+      slot->in_pos = 0;
+      slot->last = false;
+      slot->state = slot_free;
+    }
+  z->head = 0;
+  z->tail = 0;
+  z->holding = false;
+  z->eof = false;
+  z->quit = false;
+
+  pthread_mutex_init(& z->mutex, nullptr);
+  pthread_cond_init(& z->cond, nullptr);
+
+  if (pthread_create(& z->reader, nullptr, decompress_reader, z) != 0) {
+    fatal(error_prefix, "Cannot create thread.");
+  }
+
+  z->workers = new pthread_t[static_cast<uint64_t>(z->worker_count) + 1];
+  for(int64_t i = 0; i < z->worker_count; i++)
+    {
+      if (pthread_create(z->workers + i, nullptr, decompress_worker, z) != 0) {
+        fatal(error_prefix, "Cannot create thread.");
+      }
+    }
+
+  return z;
+}
+
+
+auto decompress_next(struct decompress_s * z,
+                     const char ** data,
+                     size_t * len) -> bool
+{
+  /* give back the previous buffer and wait for the next one */
+
+  pthread_mutex_lock(& z->mutex);
+
+  if (z->holding)
+    {
+      z->slots[(z->tail - 1) % z->slot_count].state = slot_free;
+      z->holding = false;
+      pthread_cond_broadcast(& z->cond);
+    }
+
+  if (z->eof)
+    {
+      pthread_mutex_unlock(& z->mutex);
+      return false;
+    }
+
+  struct decompress_slot_s * slot = z->slots + (z->tail % z->slot_count);
+  while ((z->tail == z->head) || (slot->state != slot_ready)) {
+    pthread_cond_wait(& z->cond, & z->mutex);
+  }
+
+  z->tail++;
+  z->holding = true;
+  z->out_pos = slot->in_pos;
+  if (slot->last) {
+    z->eof = true;
+  }
+
+  pthread_mutex_unlock(& z->mutex);
+
+  * data = slot->out;
+  * len = slot->out_len;
+  return ! slot->last;
+}
+
+
+auto decompress_getpos(struct decompress_s * z) -> uint64_t
+{
+  return z->out_pos;
+}
+
+
+auto decompress_close(struct decompress_s * z) -> void
+{
+  pthread_mutex_lock(& z->mutex);
+  z->quit = true;
+  pthread_cond_broadcast(& z->cond);
+  pthread_mutex_unlock(& z->mutex);
+
+  pthread_join(z->reader, nullptr);
+  for(int64_t i = 0; i < z->worker_count; i++) {
+    pthread_join(z->workers[i], nullptr);
+  }
+  delete [] z->workers;
+
+  pthread_cond_destroy(& z->cond);
+  pthread_mutex_destroy(& z->mutex);
+
+  for(uint64_t i = 0; i < z->slot_count; i++)
+    {
+      if (z->slots[i].in != nullptr) {
+        xfree(z->slots[i].in);
+      }
+      if (z->slots[i].out != nullptr) {
+        xfree(z->slots[i].out);
+      }
+    }
+  xfree(z->slots);
+  xfree(z->prefix);
+  xfree(z);
+}
@@ -0,0 +1,53 @@
+/*
+    Copyright (C) 2012-2023 Torbjorn Rognes and Frederic Mahe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Torbjorn Rognes <torognes@ifi.uio.no>,
+    Department of Informatics, University of Oslo,
+    PO Box 1080 Blindern, NO-0316 Oslo, Norway
+*/
+
+/*
+  Decompression of gzip (including multi-member and BGZF) and zstd
+  input on separate threads. The decompressed data is delivered in
+  order in a ring of buffers. The zlib and zstd libraries are loaded
+  at run time, only when needed.
+*/
+
+enum decompress_format
+  {
+    decompress_none,
+    decompress_gzip,
+    decompress_bgzf,
+    decompress_zstd
+  };
+
+constexpr size_t decompress_magic_size {18};
+
+auto decompress_detect(const unsigned char * magic, size_t len) -> decompress_format;
+
+auto decompress_open(std::FILE * fp,
+                     decompress_format format,
+                     const char * prefix,
+                     size_t prefix_len,
+                     int64_t threads) -> struct decompress_s *;
+
+auto decompress_next(struct decompress_s * z,
+                     const char ** data,
+                     size_t * len) -> bool;
+
+auto decompress_getpos(struct decompress_s * z) -> uint64_t;
+
+auto decompress_close(struct decompress_s * z) -> void;
@@ -0,0 +1,191 @@
+/*
+    Copyright (C) 2012-2023 Torbjorn Rognes and Frederic Mahe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Torbjorn Rognes <torognes@ifi.uio.no>,
+    Department of Informatics, University of Oslo,
+    PO Box 1080 Blindern, NO-0316 Oslo, Norway
+*/
+
+#include "main.h"
+
+const signed char map_nt[256] =
+  {
+    // AaNn = 0, Cc = 1, Gg = 2, TtUu = 3, rest = -1
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1,  0, -1,  1, -1, -1, -1,  2, -1, -1, -1, -1, -1, -1,  0, -1,
+    -1, -1, -1, -1,  3,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1,  0, -1,  1, -1, -1, -1,  2, -1, -1, -1, -1, -1, -1,  0, -1,
+    -1, -1, -1, -1,  3,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+  };
+
+
+/*
+  The letters are made upper case by clearing bit 5, which maps only
+  the lower case letters onto the upper case ones. Each byte is then
+  compared with A, C, G, T, U and N, and the 2-bit codes (one per
+  byte) are packed by shifting and merging neighbouring lanes of
+  increasing width: 16, 32 and 64 bits.
+*/
+
+auto nt_encode_block_scalar(const char * p, uint64_t * bits) -> bool
+{
+  /* used only where no vector instructions are available */
+
+  static constexpr unsigned char invalid {0x80};  // sign bit of -1 in map_nt
+  uint64_t result {0};
+  unsigned char flags {0};
+
+  for(auto i = 0U; i < nt_encode_blocksize; i++)
+    {
+      const auto m = static_cast<unsigned char>(map_nt[static_cast<unsigned char>(p[i])]);
+      flags |= m;
+      result |= static_cast<uint64_t>(m & 3U) << (2 * i);
+    }
+
+  if ((flags & invalid) != 0) {
+    return false;
+  }
+
+  * bits = result;
+  return true;
+}
+
+
+#ifdef __SSE2__
+
+inline auto nt_encode_16_sse2(const char * p, uint32_t * bits) -> bool
+{
+  const __m128i c = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)),
+                                  _mm_set1_epi8(static_cast<char>(0xdf)));
+
+  const __m128i is_a = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('A')),
+                                    _mm_cmpeq_epi8(c, _mm_set1_epi8('N')));
+  const __m128i is_c = _mm_cmpeq_epi8(c, _mm_set1_epi8('C'));
+  const __m128i is_g = _mm_cmpeq_epi8(c, _mm_set1_epi8('G'));
+  const __m128i is_t = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('T')),
+                                    _mm_cmpeq_epi8(c, _mm_set1_epi8('U')));
+
+  const __m128i valid = _mm_or_si128(_mm_or_si128(is_a, is_c),
+                                     _mm_or_si128(is_g, is_t));
+  if (_mm_movemask_epi8(valid) != 0xffff) {
+    return false;
+  }
+
+  __m128i x = _mm_or_si128(_mm_or_si128(_mm_and_si128(is_c, _mm_set1_epi8(1)),
+                                        _mm_and_si128(is_g, _mm_set1_epi8(2))),
+                           _mm_and_si128(is_t, _mm_set1_epi8(3)));
+
+  x = _mm_and_si128(_mm_or_si128(x, _mm_srli_epi16(x, 6)), _mm_set1_epi16(0x000f));
+  x = _mm_and_si128(_mm_or_si128(x, _mm_srli_epi32(x, 12)), _mm_set1_epi32(0x00ff));
+  x = _mm_or_si128(x, _mm_srli_epi64(x, 24));
+
+  const auto lo = static_cast<uint32_t>(_mm_cvtsi128_si32(x)) & 0xffffU;
+  const auto hi = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_unpackhi_epi64(x, x))) & 0xffffU;
+  * bits = lo | (hi << 16);
+  return true;
+}
+
+auto nt_encode_block_sse2(const char * p, uint64_t * bits) -> bool
+{
+  uint32_t lo {0};
+  uint32_t hi {0};
+  if (! (nt_encode_16_sse2(p, & lo) && nt_encode_16_sse2(p + 16, & hi))) {
+    return false;
+  }
+  * bits = static_cast<uint64_t>(lo) | (static_cast<uint64_t>(hi) << 32);
+  return true;
+}
+
+#endif
+
+
+#ifdef __aarch64__
+
+inline auto nt_encode_16_neon(const char * p, uint32_t * bits) -> bool
+{
+  const uint8x16_t c = vandq_u8(vld1q_u8(reinterpret_cast<const uint8_t *>(p)),
+                                vdupq_n_u8(0xdf));
+
+  const uint8x16_t is_a = vorrq_u8(vceqq_u8(c, vdupq_n_u8('A')),
+                                   vceqq_u8(c, vdupq_n_u8('N')));
+  const uint8x16_t is_c = vceqq_u8(c, vdupq_n_u8('C'));
+  const uint8x16_t is_g = vceqq_u8(c, vdupq_n_u8('G'));
+  const uint8x16_t is_t = vorrq_u8(vceqq_u8(c, vdupq_n_u8('T')),
+                                   vceqq_u8(c, vdupq_n_u8('U')));
+
+  const uint8x16_t valid = vorrq_u8(vorrq_u8(is_a, is_c), vorrq_u8(is_g, is_t));
+  if (vminvq_u8(valid) != 0xff) {
+    return false;
+  }
+
+  const uint8x16_t x = vorrq_u8(vorrq_u8(vandq_u8(is_c, vdupq_n_u8(1)),
+                                         vandq_u8(is_g, vdupq_n_u8(2))),
+                                vandq_u8(is_t, vdupq_n_u8(3)));
+
+  uint16x8_t x16 = vreinterpretq_u16_u8(x);
+  x16 = vandq_u16(vorrq_u16(x16, vshrq_n_u16(x16, 6)), vdupq_n_u16(0x000f));
+  uint32x4_t x32 = vreinterpretq_u32_u16(x16);
+  x32 = vandq_u32(vorrq_u32(x32, vshrq_n_u32(x32, 12)), vdupq_n_u32(0x00ff));
+  uint64x2_t x64 = vreinterpretq_u64_u32(x32);
+  x64 = vorrq_u64(x64, vshrq_n_u64(x64, 24));
+
+  const auto lo = static_cast<uint32_t>(vgetq_lane_u64(x64, 0)) & 0xffffU;
+  const auto hi = static_cast<uint32_t>(vgetq_lane_u64(x64, 1)) & 0xffffU;
+  * bits = lo | (hi << 16);
+  return true;
+}
+
+auto nt_encode_block_neon(const char * p, uint64_t * bits) -> bool
+{
+  uint32_t lo {0};
+  uint32_t hi {0};
+  if (! (nt_encode_16_neon(p, & lo) && nt_encode_16_neon(p + 16, & hi))) {
+    return false;
+  }
+  * bits = static_cast<uint64_t>(lo) | (static_cast<uint64_t>(hi) << 32);
+  return true;
+}
+
+#endif
+
+
+auto (*nt_encode_block)(const char * p, uint64_t * bits) -> bool
+  = nt_encode_block_scalar;
+
+auto nt_encode_init() -> void
+{
+  /* select the fastest encoder supported by the cpu */
+
+#if defined __x86_64__
+  nt_encode_block = __builtin_cpu_supports("avx2") ?
+    nt_encode_block_avx2 : nt_encode_block_sse2;
+#elif defined __aarch64__
+  nt_encode_block = nt_encode_block_neon;
+#else
+  nt_encode_block = nt_encode_block_scalar;
+#endif
+}
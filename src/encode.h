@@ -19,9 +19,24 @@
     PO Box 1080 Blindern, NO-0316 Oslo, Norway
 */
 
-// pseudo random number generator:
-// Mersenne Twister uint64 uniform distribution
-// (initialized only once for reproducibility,
-//  then each call produces a distinct uint64 value)
-constexpr static unsigned int seed {1};
-static std::mt19937_64 rand_64(seed);
+/*
+  Vectorised encoding of nucleotide sequences. A block of 32
+  characters is converted into 32 nucleotides packed two bits each
+  into a 64-bit word (A=00, C=01, G=10, T=11, first nt in bits 0-1).
+  Returns false if the block contains anything else than the letters
+  ACGTUN in upper or lower case (e.g. newlines), leaving those blocks
+  to the character by character encoder.
+*/
+
+constexpr unsigned int nt_encode_blocksize {32};
+
+/* code of each character: AaNn = 0, Cc = 1, Gg = 2, TtUu = 3, rest = -1 */
+extern const signed char map_nt[256];
+
+extern auto (*nt_encode_block)(const char * p, uint64_t * bits) -> bool;
+
+auto nt_encode_init() -> void;
+
+#ifdef __x86_64__
+auto nt_encode_block_avx2(const char * p, uint64_t * bits) -> bool;
+#endif
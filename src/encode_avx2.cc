@@ -0,0 +1,61 @@
+/*
+    Copyright (C) 2012-2023 Torbjorn Rognes and Frederic Mahe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Torbjorn Rognes <torognes@ifi.uio.no>,
+    Department of Informatics, University of Oslo,
+    PO Box 1080 Blindern, NO-0316 Oslo, Norway
+*/
+
+/* AVX2 version of the nucleotide encoder, compiled with -mavx2 */
+
+#include "main.h"
+
+#ifdef __AVX2__
+
+auto nt_encode_block_avx2(const char * p, uint64_t * bits) -> bool
+{
+  const __m256i c = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)),
+                                     _mm256_set1_epi8(static_cast<char>(0xdf)));
+
+  const __m256i is_a = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('A')),
+                                       _mm256_cmpeq_epi8(c, _mm256_set1_epi8('N')));
+  const __m256i is_c = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('C'));
+  const __m256i is_g = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('G'));
+  const __m256i is_t = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('T')),
+                                       _mm256_cmpeq_epi8(c, _mm256_set1_epi8('U')));
+
+  const __m256i valid = _mm256_or_si256(_mm256_or_si256(is_a, is_c),
+                                        _mm256_or_si256(is_g, is_t));
+  if (_mm256_movemask_epi8(valid) != -1) {
+    return false;
+  }
+
+  __m256i x = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(is_c, _mm256_set1_epi8(1)),
+                                              _mm256_and_si256(is_g, _mm256_set1_epi8(2))),
+                              _mm256_and_si256(is_t, _mm256_set1_epi8(3)));
+
+  x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi16(x, 6)), _mm256_set1_epi16(0x000f));
+  x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi32(x, 12)), _mm256_set1_epi32(0x00ff));
+  x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi64(x, 24)), _mm256_set1_epi64x(0xffff));
+
+  /* merge the four 16-bit results, one in each 64-bit lane */
+  x = _mm256_or_si256(x, _mm256_srli_si256(x, 6));
+  * bits = static_cast<uint64_t>(static_cast<uint32_t>(_mm256_extract_epi32(x, 0)))
+    | (static_cast<uint64_t>(static_cast<uint32_t>(_mm256_extract_epi32(x, 4))) << 32);
+  return true;
+}
+
+#endif
@@ -21,7 +21,8 @@
 
 /* Kmercounter using Bloom filter and rapid hash function */
 
-/* Works with kmers of length up to k=32 */
+/* Works with kmers of length up to k=64 */
+/* Kmers of up to 32 nt in 64 bits, longer ones in 128 bits */
 /* Uses a 64 bit hash */
 
 /*
@@ -52,17 +53,128 @@
 
 static unsigned int k = 31; // Default 31
 
-static uint64_t unique = 0;
+/* count kmers on both strands, optionally with separate reverse counts */
+static bool canonical = false;
+static bool strand_counts = false;
+static uint64_t * count_reverse = nullptr;
+
+/* state shared by the reading and counting threads */
+
+static const uint64_t count_batch_size = 1 << 20; /* bytes per batch */
+
+static pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t count_cond_free = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t count_cond_full = PTHREAD_COND_INITIALIZER;
+static struct db_stream_s * count_stream = nullptr;
+static struct bloomflex_s * count_bloom = nullptr;
+static void * count_index = nullptr;
+
+/* batches of sequences, either free or full and waiting to be counted,
+   the full ones counted in the order read, with serial numbers */
+static struct db_s ** count_batches_free = nullptr;
+static struct db_s ** count_batches_full = nullptr;
+static uint64_t * count_serials_full = nullptr;
+static uint64_t count_batch_count = 0;
+static uint64_t count_free = 0;
+static uint64_t count_full = 0;
+static uint64_t count_full_first = 0;
+static uint64_t count_serial_read = 0;
+static bool count_eof = false;
+
+/* output for each record, the batches written in turn by serial number */
+static pthread_cond_t count_cond_written = PTHREAD_COND_INITIALIZER;
+static uint64_t count_serial_written = 0;
+static std::FILE * record_file = nullptr;
+static bool record_kmers = false;  /* list the matching kmers */
+static const char * record_sample = nullptr;  /* first column, if any */
+
+struct record_s
+{
+  unsigned int number;
+  const char * name;  /* nullptr if started in an earlier batch */
+  uint64_t matches;
+  uint64_t matched_first;  /* its matching kmers in the list of the batch */
+  uint64_t matched_end;
+};
+
+/* the last record written, which may continue in the next batch */
+static bool record_pending = false;
+static std::string record_pending_name;
+static uint64_t record_pending_matches = 0;
+static std::vector<uint64_t> record_pending_kmers;
+
+/* counters of the lookups, to see how well the Bloom filter works */
+struct check_stats_s
+{
+  uint64_t batches;     /* batches counted */
+  uint64_t kmers;       /* kmers looked up */
+  uint64_t bloom_hits;  /* kmers that passed the Bloom filter */
+  uint64_t matches;     /* kmers found in the index */
+};
+
+/*
+  The lookup engine: the kmers are tested with the Bloom filter before
+  the index, or looked up in the index directly, or either one,
+  chosen for each batch from the hit rate of the previous one.
+*/
+
+enum engine_e
+  {
+    engine_bloom,
+    engine_direct,
+    engine_adaptive
+  };
 
-struct hashentry
+static enum engine_e count_engine = engine_bloom;
+
+/* percent of kmers passing the filter to go direct, matching to go back */
+static const uint64_t adaptive_direct = 95;
+static const uint64_t adaptive_bloom = 90;
+static const uint64_t adaptive_den = 100;
+
+/* the counters of the lookups without and with the Bloom filter */
+static struct check_stats_s count_stats[2];
+
+struct result_s
 {
   uint64_t kmer;
-  uint64_t count;
+  uint64_t high;     /* nucleotides 33-64, with k > 32 */
+  uint64_t count;    /* both strands */
+  uint64_t reverse;  /* reverse strand, with separate strand counts */
+  uint64_t slot;
 };
 
+/* the counts of one sequence file, when there are several */
+struct sample_count_s
+{
+  uint64_t slot;     /* slot in the index, later row in the output */
+  uint64_t count;    /* both strands */
+  uint64_t reverse;
+};
+
+struct sample_s
+{
+  std::string name;
+  std::vector<struct sample_count_s> counts;  /* matching kmers only */
+};
+
+/* result lines formatted by several threads, one chunk each */
+static const uint64_t write_chunk = 1 << 16; /* lines per chunk */
+static const uint64_t write_line_max = writer_kmer_max +
+  3 * (writer_uint64_max + 1) + 1;
+static struct result_s * write_results = nullptr;
+static uint64_t write_first = 0;
+static uint64_t write_last = 0;
+static char ** write_text = nullptr;
+static uint64_t * write_length = nullptr;
+
 static const unsigned int shift_factor = 2;
 
-static const uint64_t hashvalues[4] =
+/* with k > 32, nucleotides 32 apart would get the same rotation,
+   and cancel each other if equal, so the hash is rotated by one bit */
+static const unsigned int shift_factor_wide = 1;
+
+static constexpr uint64_t hashvalues[4] =
   {
     /* These pseudo-random constants should perhaps be choosen wisely? */
     0xba64e57c490e2ef4,
@@ -71,21 +183,19 @@ static const uint64_t hashvalues[4] =
     0x02db58f212586265
   };
 
-static const uint64_t hashvalues_rot60[4] =
-  {
-    0x4ba64e57c490e2ef,
-    0xf4938a808abe1edc,
-    0xa715849e4da68576,
-    0x502db58f21258626
-  };
-
-inline uint64_t rotate_left_64(uint64_t x, unsigned int r)
+constexpr uint64_t rotate_left_64(uint64_t x, unsigned int r)
 {
   /* rotate value in x by r places to the left */
   /* 0 <= r <= 64 */
   /* operates on 64 bit values */
 
-  return (x << r) | (x >> (64 - r));
+  return ((r & 63) == 0) ? x : (x << r) | (x >> (64 - r));
+}
+
+constexpr uint64_t kmer_mask(unsigned int k)
+{
+  /* the 2k lowest bits, holding a kmer */
+  return (k == 32) ? (uint64_t) -1 : (1ULL << (2 * k)) - 1;
 }
 
 inline uint64_t reverse_nucleotides(unsigned int k, uint64_t kmer)
@@ -102,6 +212,12 @@ inline uint64_t reverse_nucleotides(unsigned int k, uint64_t kmer)
   return res;
 }
 
+inline uint64_t reverse_complement(unsigned int k, uint64_t kmer)
+{
+  /* complement is 3 - x for each nucleotide x */
+  return reverse_nucleotides(k, ~ kmer);
+}
+
 uint64_t hash_full(unsigned int k, uint64_t kmer)
 {
   /* compute 64 bit rolling hash of given k-mer from scratch */
@@ -121,13 +237,87 @@ uint64_t hash_full(unsigned int k, uint64_t kmer)
   return hash;
 }
 
-inline uint64_t hash_update(uint64_t k, uint64_t h, uint64_t out, uint64_t in)
+/*
+  Kmers longer than 32 nucleotides, with k from 33 to 64, in 128 bits
+  with the first nucleotide in the lowest bits, as the shorter ones.
+*/
+
+inline kmer_wide_t kmer_mask_wide(unsigned int k)
+{
+  return (k == 64) ? ~ kmer_wide_t { 0 } : (kmer_wide_t { 1 } << (2 * k)) - 1;
+}
+
+inline kmer_wide_t reverse_complement(unsigned int k, kmer_wide_t kmer)
+{
+  /* both words reversed and swapped, then shifted down to k */
+  const kmer_wide_t low = reverse_complement(32, static_cast<uint64_t>(kmer));
+  const kmer_wide_t high = reverse_complement(32, static_cast<uint64_t>(kmer >> 64));
+  return ((low << 64) | high) >> (2 * (64 - k));
+}
+
+uint64_t hash_full(unsigned int k, kmer_wide_t kmer)
+{
+  /* compute 64 bit rolling hash of given long k-mer from scratch */
+
+  uint64_t hash = 0;
+
+  for (unsigned int i = 0; i < k; i++)
+    {
+      hash = rotate_left_64(hash, shift_factor_wide);
+      hash ^= hashvalues[static_cast<uint64_t>(kmer >> (i << 1)) & 3];
+    }
+
+  return hash;
+}
+
+/*
+  The functions below are templates on the kmer length K, so that the
+  shifts, masks and rotations depending on it are constants in the
+  inner loops. They are instantiated for every K from 1 to 32 and
+  selected once through a dispatch table.
+*/
+
+template <unsigned int K>
+struct hash_rotated
+{
+  /* the hash values rotated by 2(K-1): the value of the first
+     nucleotide of a kmer in its hash */
+  static constexpr uint64_t value(uint64_t x)
+  {
+    return rotate_left_64(hashvalues[x], shift_factor * (K - 1));
+  }
+};
+
+template <unsigned int K>
+inline uint64_t hash_full(uint64_t kmer)
+{
+  /* compute 64 bit rolling hash of given k-mer from scratch */
+
+  uint64_t hash = 0;
+
+  for (unsigned int i = 0; i < K; i++)
+    {
+      hash = rotate_left_64(hash, shift_factor);
+      hash ^= hashvalues[(kmer >> (i << 1)) & 3];
+    }
+
+  return hash;
+}
+
+template <unsigned int K>
+inline uint64_t hash_update(uint64_t h, uint64_t out, uint64_t in)
 {
   /* update 64 bit rolling hash with a new nucleotide */
+  static constexpr uint64_t rot[4] =
+    {
+      hash_rotated<K>::value(0), hash_rotated<K>::value(1),
+      hash_rotated<K>::value(2), hash_rotated<K>::value(3)
+    };
+
   uint64_t hash = h;
 
-  /* remove value going out (rotation may be precomputed for fixed k)*/
-  hash ^= rotate_left_64(hashvalues[out], shift_factor * (k - 1ULL));
+  /* remove value going out */
+  hash ^= rot[out];
 
   /* rotate hash */
   hash = rotate_left_64(hash, shift_factor);
@@ -138,315 +328,1878 @@ inline uint64_t hash_update(uint64_t k, uint64_t h, uint64_t out, uint64_t in)
   return hash;
 }
 
-inline uint64_t hash_update_31(uint64_t h, uint64_t out, uint64_t in)
+template <unsigned int K>
+inline uint64_t hash_update_rc(uint64_t h, uint64_t out, uint64_t in)
 {
-  /* update 64 bit rolling hash with a new nucleotide */
+  /*
+    update 64 bit rolling hash of the reverse complement, where the
+    complement of the new nucleotide enters at the start and the
+    complement of the old one leaves at the end
+  */
+  static constexpr uint64_t rot[4] =
+    {
+      hash_rotated<K>::value(0), hash_rotated<K>::value(1),
+      hash_rotated<K>::value(2), hash_rotated<K>::value(3)
+    };
+
   uint64_t hash = h;
 
-  /* remove value going out (rotation may be precomputed for fixed k)*/
-  hash ^= hashvalues_rot60[out];
+  /* remove value going out (not rotated) */
+  hash ^= hashvalues[3 - out];
 
-  /* rotate hash */
-  hash = rotate_left_64(hash, shift_factor);
+  /* rotate hash the other way */
+  hash = rotate_left_64(hash, 64 - shift_factor);
 
-  /* insert value coming in */
-  hash ^= hashvalues[in];
+  /* insert value coming in, rotated by 2(K-1) */
+  hash ^= rot[3 - in];
 
   return hash;
 }
 
-void hash_insert(uint64_t hash,
-		 uint64_t kmer,
-		 hashentry *  seqhashtable,
-		 uint64_t seqhashsize)
+/*
+  The kmers are indexed either by the hash table or by a minimal
+  perfect hash function, with the same functions for both.
+*/
+
+inline void index_prefetch(kmerhash_s * table, uint64_t hash)
+{
+  kmerhash_prefetch(table, hash);
+}
+
+inline void index_prefetch(mphf_s * table, uint64_t hash)
+{
+  mphf_prefetch(table, hash);
+}
+
+inline uint64_t index_candidate(kmerhash_s * table, uint64_t hash)
+{
+  return kmerhash_candidate(table, hash);
+}
+
+inline uint64_t index_candidate(mphf_s * table, uint64_t hash)
+{
+  return mphf_candidate(table, hash);
+}
+
+inline bool index_absent(kmerhash_s * table, uint64_t hint)
+{
+  /* the candidate shows that the kmer is not in the index */
+  (void) table;
+  return hint == kmerhash_none;
+}
+
+inline bool index_absent(mphf_s * table, uint64_t hint)
+{
+  (void) table;
+  (void) hint;
+  return false;
+}
+
+inline uint64_t index_find(kmerhash_s * table, uint64_t hash, uint64_t key,
+			   uint64_t kmer, uint64_t kmer_rc, uint64_t hint)
+{
+  (void) key;
+  return kmerhash_find(table, hash, kmer, kmer_rc, hint);
+}
+
+inline uint64_t index_find(mphf_s * table, uint64_t hash, uint64_t key,
+			   uint64_t kmer, uint64_t kmer_rc, uint64_t hint)
+{
+  return mphf_find(table, hash, key, kmer, kmer_rc, hint);
+}
+
+template <typename T>
+inline uint64_t hash_count(T * table,
+		       uint64_t hash,
+		       uint64_t key,
+		       uint64_t kmer,
+		       uint64_t kmer_rc,
+		       uint64_t hint)
 {
-  uint64_t seqhashindex = hash % seqhashsize;
+  /*
+    the index holds the kmers as given, look for both strands
+    (kmer_rc is equal to kmer unless canonical)
+  */
+
+  uint64_t slot = index_find(table, hash, key, kmer, kmer_rc, hint);
+  if (slot == kmerhash_none)
+    return slot;
+
+  /* match, count it (the table is shared by all threads),
+     on the reverse strand apart if requested */
+  uint64_t * c = & table->slots[slot].count;
+  if (count_reverse && (table->slots[slot].kmer != kmer))
+    c = count_reverse + slot;
+  __atomic_fetch_add(c, 1, __ATOMIC_RELAXED);
+  return slot;
+}
+
+/*
+  The lookups of the kmers in the Bloom filter and the hash table are
+  random memory accesses, and mostly cache misses with large kmer
+  sets. The kmers are therefore looked up in batches (group
+  prefetching): first the hashes of a batch of positions are computed
+  and their Bloom filter words prefetched, then the Bloom filter is
+  tested and the hash table slots of the hits are prefetched, and at
+  last the hits are counted. This way many misses are in flight at
+  the same time.
+
+  When the index is small enough to stay in the cache, the Bloom
+  filter only adds work, and B (Bloom) is false: all positions are
+  then looked up in the index directly.
+*/
 
-  while (1)
+static const unsigned int check_batch = 32; /* positions per batch */
+
+template <unsigned int K, bool C, bool B, typename T>
+uint64_t kmer_check(unsigned int seqlen, char * seq, bloomflex_s * bloom,
+		    void * index, std::vector<uint64_t> * matched,
+		    struct check_stats_s * stats)
+{
+  /*
+    With C (canonical), roll the kmer and its reverse complement
+    together, and look up the one of them that is smaller, using its
+    hash. T is the type of the index. Returns the number of matches,
+    and adds the matching kmers (as given) to matched, if not null.
+    The lookups are added to stats.
+  */
+
+  if (seqlen < K)
+    return 0;
+
+  T * table = static_cast<T *>(index);
+
+  uint64_t hashes[check_batch];
+  uint64_t kmers[check_batch];
+  uint64_t kmers_rc[check_batch];
+  unsigned int hits[check_batch];
+  uint64_t hints[check_batch];
+
+  /* first kmer */
+  uint64_t * p = (uint64_t *) seq;
+  uint64_t mem = *p++;
+  uint64_t kmer = mem & kmer_mask(K);
+  uint64_t kmer_rc = C ? reverse_complement(K, kmer) : 0;
+  mem = (K == 32) ? 0 : mem >> (2 * K % 64);
+
+  uint64_t h = hash_full<K>(kmer);
+  uint64_t h_rc = C ? hash_full<K>(kmer_rc) : 0;
+
+  unsigned int i = K;  /* next nucleotide to roll in */
+  unsigned int remaining = seqlen - K + 1;  /* kmers left */
+  bool first = true;
+  uint64_t matches = 0;
+
+  while (remaining > 0)
     {
-      uint64_t kmerfound = seqhashtable[seqhashindex].kmer;
+      const unsigned int n = std::min(remaining, check_batch);
 
-      if (kmerfound == (uint64_t) - 1)
+      /* roll the hashes, prefetch the bloom filter words */
+      for (unsigned int j = 0; j < n; j++)
 	{
-	  /* free slot, not seen before, insert new, zero count */
-	  seqhashtable[seqhashindex].kmer = kmer;
-	  seqhashtable[seqhashindex].count = 0;
-	  unique++;
-	  return;
+	  if (! first)
+	    {
+	      if ((i & 31) == 0)
+		mem = *p++;
+
+	      uint64_t out = kmer & 3;
+	      uint64_t in = mem & 3;
+	      kmer >>= 2;
+	      kmer |= in << (2 * (K - 1));
+	      mem >>= 2;
+	      h = hash_update<K>(h, out, in);
+
+	      if (C)
+		{
+		  kmer_rc = ((kmer_rc << 2) | (3 - in)) & kmer_mask(K);
+		  h_rc = hash_update_rc<K>(h_rc, out, in);
+		}
+	      i++;
+	    }
+	  first = false;
+
+	  kmers[j] = kmer;
+	  if (C)
+	    {
+	      kmers_rc[j] = kmer_rc;
+	      hashes[j] = (kmer <= kmer_rc) ? h : h_rc;
+	    }
+	  else
+	    hashes[j] = h;
+	  if (B)
+	    bloomflex_prefetch(bloom, hashes[j]);
 	}
 
-      if (kmerfound == kmer)
+      /* test the bloom filter, prefetch the hash table slots */
+      unsigned int hit_count = 0;
+      for (unsigned int j = 0; j < n; j++)
+	if (! B || bloomflex_get(bloom, hashes[j]))
+	  {
+	    index_prefetch(table, hashes[j]);
+	    hits[hit_count++] = j;
+	  }
+
+      if (B)
+	stats->bloom_hits += hit_count;
+
+      /* find the likely slots of the hits, prefetch them */
+      for (unsigned int x = 0; x < hit_count; x++)
+	hints[x] = index_candidate(table, hashes[hits[x]]);
+
+      /* count the hits */
+      for (unsigned int x = 0; x < hit_count; x++)
 	{
-	  /* slot in use, with match */
-	  return;
+	  if (index_absent(table, hints[x]))
+	    continue;
+	  const unsigned int j = hits[x];
+	  uint64_t slot;
+	  if (C)
+	    slot = hash_count(table, hashes[j], std::min(kmers[j], kmers_rc[j]),
+			      kmers[j], kmers_rc[j], hints[x]);
+	  else
+	    slot = hash_count(table, hashes[j], kmers[j], kmers[j], kmers[j],
+			      hints[x]);
+	  if (slot != kmerhash_none)
+	    {
+	      matches++;
+	      if (matched)
+		matched->push_back(table->slots[slot].kmer);
+	    }
 	}
 
-      /* in use, but no match, try next */
-      seqhashindex = (seqhashindex + 1) % seqhashsize;
+      remaining -= n;
     }
+
+  stats->kmers += seqlen - K + 1;
+  stats->matches += matches;
+  return matches;
 }
 
-inline void hash_count(uint64_t hash,
-		       uint64_t kmer,
-		       hashentry *  seqhashtable,
-		       uint64_t seqhashsize)
+/* dispatch table of the kmer_check functions, indexed by index type
+   (hash table or mphf), canonical, Bloom filter used and k */
+
+typedef uint64_t (*kmer_check_t)(unsigned int, char *, bloomflex_s *, void *,
+				 std::vector<uint64_t> *,
+				 struct check_stats_s *);
+
+static kmer_check_t kmer_check_table[2][2][2][33];
+
+template <unsigned int K>
+struct kmer_check_fill
 {
-  uint64_t seqhashindex = hash % seqhashsize;
+  static void fill()
+  {
+    kmer_check_table[0][0][0][K] = kmer_check<K, false, false, kmerhash_s>;
+    kmer_check_table[0][0][1][K] = kmer_check<K, false, true, kmerhash_s>;
+    kmer_check_table[0][1][0][K] = kmer_check<K, true, false, kmerhash_s>;
+    kmer_check_table[0][1][1][K] = kmer_check<K, true, true, kmerhash_s>;
+    kmer_check_table[1][0][0][K] = kmer_check<K, false, false, mphf_s>;
+    kmer_check_table[1][0][1][K] = kmer_check<K, false, true, mphf_s>;
+    kmer_check_table[1][1][0][K] = kmer_check<K, true, false, mphf_s>;
+    kmer_check_table[1][1][1][K] = kmer_check<K, true, true, mphf_s>;
+    kmer_check_fill<K - 1>::fill();
+  }
+};
+
+template <>
+struct kmer_check_fill<0>
+{
+  static void fill()
+  {
+    for (unsigned int i = 0; i < 8; i++)
+      kmer_check_table[i / 4][(i / 2) % 2][i % 2][0] = nullptr;
+  }
+};
+
+inline uint64_t hash_count_wide(kmerhash_s * table,
+				uint64_t hash,
+				kmer_wide_t kmer,
+				kmer_wide_t kmer_rc,
+				uint64_t hint)
+{
+  /* as hash_count, with the hash table, for k > 32 */
+
+  uint64_t slot = kmerhash_find(table, hash, kmer, kmer_rc, hint);
+  if (slot == kmerhash_none)
+    return slot;
+
+  uint64_t * c = & table->slots[slot].count;
+  kmer_wide_t x;
+  kmerhash_load(table, slot, x);
+  if (count_reverse && (x != kmer))
+    c = count_reverse + slot;
+  __atomic_fetch_add(c, 1, __ATOMIC_RELAXED);
+  return slot;
+}
+
+template <bool C, bool B>
+uint64_t kmer_check_wide(unsigned int seqlen, char * seq, bloomflex_s * bloom,
+			 void * index, std::vector<uint64_t> * matched,
+			 struct check_stats_s * stats)
+{
+  /*
+    As kmer_check, for 33 <= k <= 64, with the kmers in 128 bits and
+    k not a constant. Only with the hash table. The matching kmers
+    are added to matched as two words each.
+  */
+
+  if (seqlen < k)
+    return 0;
+
+  kmerhash_s * table = static_cast<kmerhash_s *>(index);
+  const kmer_wide_t mask = kmer_mask_wide(k);
+
+  /* the hash values rotated as the first nucleotide of a kmer */
+  uint64_t rot[4];
+  for (unsigned int x = 0; x < 4; x++)
+    rot[x] = rotate_left_64(hashvalues[x], shift_factor_wide * (k - 1));
 
-  while (1)
+  uint64_t hashes[check_batch];
+  kmer_wide_t kmers[check_batch];
+  kmer_wide_t kmers_rc[check_batch];
+  unsigned int hits[check_batch];
+  uint64_t hints[check_batch];
+
+  /* first kmer, in the first two words */
+  uint64_t * p = (uint64_t *) seq;
+  kmer_wide_t kmer = ((kmer_wide_t { p[1] } << 64) | p[0]) & mask;
+  uint64_t mem = (k == 64) ? 0 : p[1] >> (2 * k - 64);
+  p += 2;
+  kmer_wide_t kmer_rc = C ? reverse_complement(k, kmer) : 0;
+
+  uint64_t h = hash_full(k, kmer);
+  uint64_t h_rc = C ? hash_full(k, kmer_rc) : 0;
+
+  unsigned int i = k;  /* next nucleotide to roll in */
+  unsigned int remaining = seqlen - k + 1;  /* kmers left */
+  bool first = true;
+  uint64_t matches = 0;
+
+  while (remaining > 0)
     {
-      uint64_t kmerfound = seqhashtable[seqhashindex].kmer;
+      const unsigned int n = std::min(remaining, check_batch);
 
-      if (kmerfound == (uint64_t) - 1)
+      /* roll the hashes, prefetch the bloom filter words */
+      for (unsigned int j = 0; j < n; j++)
 	{
-	  /* no match, ignore this kmer */
-	  return;
+	  if (! first)
+	    {
+	      if ((i & 31) == 0)
+		mem = *p++;
+
+	      uint64_t out = static_cast<uint64_t>(kmer) & 3;
+	      uint64_t in = mem & 3;
+	      kmer >>= 2;
+	      kmer |= kmer_wide_t { in } << (2 * (k - 1));
+	      mem >>= 2;
+	      h = rotate_left_64(h ^ rot[out], shift_factor_wide) ^ hashvalues[in];
+
+	      if (C)
+		{
+		  kmer_rc = ((kmer_rc << 2) | (3 - in)) & mask;
+		  h_rc = rotate_left_64(h_rc ^ hashvalues[3 - out],
+					64 - shift_factor_wide) ^ rot[3 - in];
+		}
+	      i++;
+	    }
+	  first = false;
+
+	  kmers[j] = kmer;
+	  if (C)
+	    {
+	      kmers_rc[j] = kmer_rc;
+	      hashes[j] = (kmer <= kmer_rc) ? h : h_rc;
+	    }
+	  else
+	    hashes[j] = h;
+	  if (B)
+	    bloomflex_prefetch(bloom, hashes[j]);
 	}
-      else if (kmerfound == kmer)
+
+      /* test the bloom filter, prefetch the hash table slots */
+      unsigned int hit_count = 0;
+      for (unsigned int j = 0; j < n; j++)
+	if (! B || bloomflex_get(bloom, hashes[j]))
+	  {
+	    kmerhash_prefetch(table, hashes[j]);
+	    hits[hit_count++] = j;
+	  }
+
+      if (B)
+	stats->bloom_hits += hit_count;
+
+      /* find the likely slots of the hits, prefetch them */
+      for (unsigned int x = 0; x < hit_count; x++)
+	hints[x] = kmerhash_candidate<kmer_wide_t>(table, hashes[hits[x]]);
+
+      /* count the hits */
+      for (unsigned int x = 0; x < hit_count; x++)
 	{
-	  /* match, count it */
-	  seqhashtable[seqhashindex].count++;
-	  return;
+	  if (hints[x] == kmerhash_none)
+	    continue;
+	  const unsigned int j = hits[x];
+	  uint64_t slot = hash_count_wide(table, hashes[j], kmers[j],
+					  C ? kmers_rc[j] : kmers[j], hints[x]);
+	  if (slot != kmerhash_none)
+	    {
+	      matches++;
+	      if (matched)
+		{
+		  matched->push_back(table->slots[slot].kmer);
+		  matched->push_back(table->high[slot]);
+		}
+	    }
 	}
 
-      /* in use, not matching, try next bucket */
-      seqhashindex = (seqhashindex + 1) % seqhashsize;
+      remaining -= n;
     }
+
+  stats->kmers += seqlen - k + 1;
+  stats->matches += matches;
+  return matches;
+}
+
+/* the kmer_check_wide functions, indexed by canonical and Bloom filter */
+static kmer_check_t kmer_check_wide_table[2][2] =
+  {
+    { kmer_check_wide<false, false>, kmer_check_wide<false, true> },
+    { kmer_check_wide<true, false>, kmer_check_wide<true, true> }
+  };
+
+/* the kmer_check functions without and with the Bloom filter */
+static kmer_check_t count_check[2] = { nullptr, nullptr };
+
+void sprintseq(char * buffer, const uint64_t * kmer)
+{
+  /* k symbols, not terminated, in a buffer of at least 64 bytes,
+     from one word, or two with k > 32 */
+  writer_format_kmer(buffer, kmer[0], (k > 32) ? kmer[1] : 0, k);
 }
 
-void kmer_check(unsigned int seqlen, char * seq, bloomflex_s * bloom, hashentry * seqhashtable, uint64_t seqhashsize)
+void record_format(std::string & text, const char * name, uint64_t matches,
+		   const uint64_t * kmers, uint64_t kmer_words)
 {
-  uint64_t kmer = 0;
-  uint64_t h = 0;
+  /* one line: sample, record identifier, matches, kmers (of one
+     word each, or two with k > 32) */
 
-  if (seqlen < k)
+  if (record_sample)
+    {
+      text += record_sample;
+      text += '\t';
+    }
+  text += name;
+  text += '\t';
+  text += std::to_string(matches);
+  if (record_kmers)
+    {
+      text += '\t';
+      char buffer[writer_kmer_max];
+      const uint64_t step = (k > 32) ? 2 : 1;
+      for (uint64_t i = 0; i < kmer_words; i += step)
+	{
+	  if (i > 0)
+	    text += ',';
+	  sprintseq(buffer, kmers + i);
+	  text.append(buffer, k);
+	}
+    }
+  text += '\n';
+}
+
+void record_flush()
+{
+  if (! record_pending)
     return;
 
-  /* first kmer */
-  uint64_t * p = (uint64_t *) seq;
-  uint64_t mem = *p++;
-  kmer = mem;
+  std::string text;
+  record_format(text, record_pending_name.c_str(), record_pending_matches,
+		record_pending_kmers.data(), record_pending_kmers.size());
+  fwrite(text.data(), 1, text.size(), record_file);
+  record_pending = false;
+}
 
-  kmer &= (1ULL << 2*k) - 1;
-  mem >>= 2*k;
+void record_collect(struct db_s * d, uint64_t * matches,
+		    std::vector<uint64_t> & matched,
+		    std::vector<record_s> & records, std::string & text)
+{
+  /*
+    Sum the matches of the parts of each record in the batch, and
+    format all records but the first, if it started in an earlier
+    batch, and the last, which may continue in the next batch.
+  */
+
+  records.clear();
+  text.clear();
 
-  h = hash_full(k, kmer);
-  if (bloomflex_get(bloom, h))
-    hash_count(h, kmer, seqhashtable, seqhashsize);
+  const unsigned int parts = db_getsequencecount(d);
+  const unsigned int started = db_getrecordcount(d);
+  const auto first = static_cast<unsigned int>(db_getfirstrecord(d));
 
-  if (k == 31)
+  if (db_getcontinued(d))
+    records.push_back({db_getrecord(d, 0), nullptr, 0, 0, 0});
+
+  const char * name = db_getnames(d);
+  for (unsigned int i = 0; i < started; i++)
     {
-      // tailored for k=31
-      for(unsigned int i = 31; i < seqlen; i++)
+      records.push_back({first + i, name, 0, 0, 0});
+      name += strlen(name) + 1;
+    }
+
+  /* the parts are in the order of the records */
+  uint64_t j = 0;
+  bool seen = false;
+  for (unsigned int i = 0; i < parts; i++)
+    {
+      const unsigned int number = db_getrecord(d, i);
+      while (records[j].number != number)
+	{
+	  j++;
+	  seen = false;
+	}
+      if (! seen)
 	{
-	  if ((i & 31) == 0)
-	    mem = *p++;
-
-	  uint64_t out = kmer & 3;
-	  uint64_t in = mem & 3;
-	  kmer >>= 2;
-	  kmer |= in << 60;
-	  mem >>= 2;
-
-	  h = hash_update_31(h, out, in);
-	  if (bloomflex_get(bloom, h))
-	    hash_count(h, kmer, seqhashtable, seqhashsize);
+	  records[j].matched_first = (i > 0) ? matches[2 * i - 1] : 0;
+	  seen = true;
 	}
+      records[j].matches += matches[2 * i];
+      records[j].matched_end = matches[2 * i + 1];
     }
-  else
+
+  const uint64_t skip = (records.size() > 0) && ! records[0].name ? 1 : 0;
+  for (uint64_t x = skip; x + 1 < records.size(); x++)
+    record_format(text, records[x].name, records[x].matches,
+		  matched.data() + records[x].matched_first,
+		  records[x].matched_end - records[x].matched_first);
+}
+
+void record_write(std::vector<uint64_t> & matched,
+		  std::vector<record_s> & records, std::string & text)
+{
+  /* write the records of the batch in its turn */
+
+  const uint64_t n = records.size();
+  uint64_t x = 0;
+
+  if ((n > 0) && ! records[0].name)
     {
-      for(unsigned int i = k; i < seqlen; i++)
+      /* continues the last record of the previous batch */
+      struct record_s * e = records.data();
+      record_pending_matches += e->matches;
+      record_pending_kmers.insert(record_pending_kmers.end(),
+				  matched.data() + e->matched_first,
+				  matched.data() + e->matched_end);
+      x = 1;
+    }
+
+  if (x < n)
+    {
+      record_flush();
+      fwrite(text.data(), 1, text.size(), record_file);
+
+      struct record_s * e = records.data() + n - 1;
+      record_pending = true;
+      record_pending_name = e->name;
+      record_pending_matches = e->matches;
+      record_pending_kmers.assign(matched.data() + e->matched_first,
+				  matched.data() + e->matched_end);
+    }
+}
+
+void count_reader()
+{
+  /* read the sequences into free batches and queue them for counting */
+
+  while (true)
+    {
+      pthread_mutex_lock(& count_mutex);
+      while (count_free == 0) {
+	pthread_cond_wait(& count_cond_free, & count_mutex);
+      }
+      struct db_s * d = count_batches_free[--count_free];
+      pthread_mutex_unlock(& count_mutex);
+
+      bool more = db_stream_next(count_stream, d, count_batch_size);
+
+      pthread_mutex_lock(& count_mutex);
+      if (more)
 	{
-	  if ((i & 31) == 0)
-	    mem = *p++;
-
-	  uint64_t out = kmer & 3;
-	  uint64_t in = mem & 3;
-	  kmer >>= 2;
-	  kmer |= in << (2*(k-1));
-	  mem >>= 2;
-
-	  h = hash_update(k, h, out, in);
-	  if (bloomflex_get(bloom, h))
-	    hash_count(h, kmer, seqhashtable, seqhashsize);
+	  const uint64_t last = (count_full_first + count_full) % count_batch_count;
+	  count_batches_full[last] = d;
+	  count_serials_full[last] = count_serial_read++;
+	  count_full++;
 	}
+      else
+	{
+	  count_batches_free[count_free++] = d;
+	  count_eof = true;
+	}
+      pthread_cond_broadcast(& count_cond_full);
+      pthread_mutex_unlock(& count_mutex);
+
+      if (! more)
+	break;
     }
 }
 
-void fprintseq(FILE * fp, uint64_t kmer)
+void count_worker(int64_t t)
 {
-  char sym_nt[5] = "ACGT";
-  char buffer[33];
-  for (unsigned int i = 0; i < k; i++)
-    buffer[i] = sym_nt[(kmer >> 2*i) & 3];
-  buffer[k] = 0;
-  fprintf(fp, "%s", buffer);
+  /* thread 0 reads, the others count kmers in full batches */
+
+  if (t == 0)
+    {
+      count_reader();
+      return;
+    }
+
+  /* per record: matches and end of the matching kmers of each part */
+  uint64_t * matches = nullptr;
+  uint64_t matches_alloc = 0;
+  std::vector<uint64_t> matched;
+  std::vector<record_s> records;
+  std::string text;
+  uint64_t batch_kmers = 0;
+  uint64_t batch_passed = 0;
+  struct check_stats_s stats[2] = { { 0, 0, 0, 0 }, { 0, 0, 0, 0 } };
+  bool bloom = count_engine != engine_direct;
+
+  while (true)
+    {
+      pthread_mutex_lock(& count_mutex);
+      while ((count_full == 0) && ! count_eof) {
+	pthread_cond_wait(& count_cond_full, & count_mutex);
+      }
+      if (count_full == 0)
+	{
+	  pthread_mutex_unlock(& count_mutex);
+	  break;
+	}
+      struct db_s * d = count_batches_full[count_full_first];
+      const uint64_t serial = count_serials_full[count_full_first];
+      count_full_first = (count_full_first + 1) % count_batch_count;
+      count_full--;
+      pthread_mutex_unlock(& count_mutex);
+
+      unsigned int seq_count = db_getsequencecount(d);
+      if (record_file && (2 * seq_count > matches_alloc))
+	{
+	  delete [] matches;
+	  matches_alloc = 2 * seq_count;
+	  matches = new uint64_t [matches_alloc];
+	}
+      matched.clear();
+
+      for(unsigned int i = 0; i < seq_count; i++)
+	{
+	  char * seq;
+	  unsigned int seqlen;
+	  db_getsequenceandlength(d, i, & seq, & seqlen);
+	  uint64_t m = count_check[bloom](seqlen, seq, count_bloom, count_index,
+					  record_kmers ? & matched : nullptr,
+					  stats + bloom);
+	  if (record_file)
+	    {
+	      matches[2 * i] = m;
+	      matches[2 * i + 1] = matched.size();
+	    }
+	}
+      stats[bloom].batches++;
+
+      /* with the adaptive engine, skip the Bloom filter for the next
+	 batch if nearly all kmers of this one passed it, and use it
+	 again when many kmers miss */
+      if (count_engine == engine_adaptive)
+	{
+	  const uint64_t kmers = stats[bloom].kmers - batch_kmers;
+	  const uint64_t passed = bloom ?
+	    stats[1].bloom_hits - batch_passed : stats[0].matches - batch_passed;
+	  if (bloom)
+	    bloom = passed * adaptive_den < kmers * adaptive_direct;
+	  else
+	    bloom = passed * adaptive_den < kmers * adaptive_bloom;
+	}
+      batch_kmers = stats[bloom].kmers;
+      batch_passed = bloom ? stats[1].bloom_hits : stats[0].matches;
+
+      if (record_file)
+	{
+	  record_collect(d, matches, matched, records, text);
+
+	  pthread_mutex_lock(& count_mutex);
+	  while (count_serial_written != serial) {
+	    pthread_cond_wait(& count_cond_written, & count_mutex);
+	  }
+	  pthread_mutex_unlock(& count_mutex);
+
+	  record_write(matched, records, text);
+
+	  pthread_mutex_lock(& count_mutex);
+	  count_serial_written++;
+	  pthread_cond_broadcast(& count_cond_written);
+	  pthread_mutex_unlock(& count_mutex);
+	}
+
+      pthread_mutex_lock(& count_mutex);
+      count_batches_free[count_free++] = d;
+      pthread_cond_signal(& count_cond_free);
+      pthread_mutex_unlock(& count_mutex);
+    }
+
+  pthread_mutex_lock(& count_mutex);
+  for (unsigned int b = 0; b < 2; b++)
+    {
+      count_stats[b].batches += stats[b].batches;
+      count_stats[b].kmers += stats[b].kmers;
+      count_stats[b].bloom_hits += stats[b].bloom_hits;
+      count_stats[b].matches += stats[b].matches;
+    }
+  pthread_mutex_unlock(& count_mutex);
+
+  delete [] matches;
 }
 
 
-void kmer_insert(unsigned int seqlen, char * seq, bloomflex_s * bloom, hashentry * seqhashtable, uint64_t seqhashsize)
+uint64_t kmer_prepare(unsigned int seqlen, char * seq,
+		      uint64_t * kmer, uint64_t * kmer_rc, uint64_t * key)
 {
-  /* find and hash all kmers in a sequence */
+  /*
+    get the kmer of a sequence, its reverse complement if canonical
+    (else the kmer again), the key to index it by (the smaller of the
+    two, or the kmer) and the hash of the key
+  */
   /* 1 <= k <= 32 */
 
-  uint64_t kmer = 0;
-  uint64_t h = 0;
-
-  if (seqlen == k)
+  if (seqlen != k)
     {
-      kmer = *((uint64_t*) seq);
-      h = hash_full(k, kmer);
-      bloomflex_set(bloom, h);
-      hash_insert(h, kmer, seqhashtable, seqhashsize);
+      fprintf(logfile, "\nFatal error: Sequence length (%u) is different from given k (%u).\n", seqlen, k);
+      exit(1);
     }
-  else
+
+  * kmer = *((uint64_t*) seq);
+  * kmer_rc = canonical ? reverse_complement(k, * kmer) : * kmer;
+  * key = std::min(* kmer, * kmer_rc);
+  return hash_full(k, * key);
+}
+
+uint64_t kmer_prepare(unsigned int seqlen, char * seq,
+		      kmer_wide_t * kmer, kmer_wide_t * kmer_rc)
+{
+  /* as above, for 33 <= k <= 64, with the kmer in two words, and
+     the smaller of kmer and kmer_rc as the key */
+
+  if (seqlen != k)
     {
       fprintf(logfile, "\nFatal error: Sequence length (%u) is different from given k (%u).\n", seqlen, k);
       exit(1);
     }
+
+  const uint64_t * p = (const uint64_t *) seq;
+  * kmer = (kmer_wide_t { p[1] } << 64) | p[0];
+  * kmer_rc = canonical ? reverse_complement(k, * kmer) : * kmer;
+  return hash_full(k, std::min(* kmer, * kmer_rc));
 }
 
-int compare_kmers(const void * a, const void * b)
+inline bool result_before(const struct result_s & x, const struct result_s & y)
 {
-  const struct hashentry * x = (struct hashentry *)(a);
-  const struct hashentry * y = (struct hashentry *)(b);
+  /* by descending count, then by kmer, its upper word first */
+  if (x.count != y.count)
+    return x.count > y.count;
+  return (x.high < y.high) || ((x.high == y.high) && (x.kmer < y.kmer));
+}
 
-  // Compare kmer counts, sort by decending order
-  if (x->count > y->count)
-    return -1;
-  else if (x->count < y->count)
-    return +1;
+inline unsigned int result_digit(const struct result_s & e, unsigned int p)
+{
+  /* byte p of the sort key: the kmer, its upper word, then the
+     complemented count */
+  if (p < 8)
+    return (e.kmer >> (8 * p)) & 255;
+  else if (p < 16)
+    return (e.high >> (8 * (p - 8))) & 255;
   else
+    return (~ e.count >> (8 * (p - 16))) & 255;
+}
+
+void sort_results(struct result_s * results, uint64_t n)
+{
+  /*
+    LSD radix sort by descending count and then by kmer, one byte at a
+    time, starting with the lowest byte of the kmer. The histograms of
+    all 24 bytes are made in a single pass, and the bytes that are the
+    same for all the results, like the high bytes of most counts, are
+    skipped. The upper word of the kmers is only used with k > 32.
+  */
+
+  static const unsigned int passes = 24;
+  static const unsigned int buckets = 256;
+
+  if (n < 2)
+    return;
+
+  unsigned int used[passes];
+  unsigned int used_count = 0;
+  for (unsigned int p = 0; p < passes; p++)
+    if ((k > 32) || (p < 8) || (p >= 16))
+      used[used_count++] = p;
+
+  uint64_t * histogram = new uint64_t [passes * buckets] { };
+  for (uint64_t i = 0; i < n; i++)
+    for (unsigned int u = 0; u < used_count; u++)
+      histogram[used[u] * buckets + result_digit(results[i], used[u])]++;
+
+  struct result_s * buffer = new result_s [n];
+  struct result_s * src = results;
+  struct result_s * dst = buffer;
+
+  for (unsigned int u = 0; u < used_count; u++)
     {
-#if 1
-      if (x->kmer < y->kmer)
-	return -1;
-      else if (x->kmer > y->kmer)
-	return +1;
-      else
-	return 0;
-#else
-      /* Too slow */
-      /* Equal count, sort by sequence */
-      uint64_t e = reverse_nucleotides(k, x->kmer);
-      uint64_t f = reverse_nucleotides(k, y->kmer);
-      if (e < f)
-	return -1;
-      else if (e > f)
-	return +1;
-      else
-	return 0;
-#endif
+      const unsigned int p = used[u];
+      uint64_t * h = histogram + p * buckets;
+      if (h[result_digit(src[0], p)] == n)
+	continue;
+
+      uint64_t sum = 0;
+      for (unsigned int b = 0; b < buckets; b++)
+	{
+	  uint64_t c = h[b];
+	  h[b] = sum;
+	  sum += c;
+	}
+
+      for (uint64_t i = 0; i < n; i++)
+	dst[h[result_digit(src[i], p)]++] = src[i];
+
+      std::swap(src, dst);
     }
+
+  if (src != results)
+    memcpy(results, src, n * sizeof(struct result_s));
+
+  delete [] buffer;
+  delete [] histogram;
 }
 
-void print_results(hashentry * seqhashtable, uint64_t seqhashsize)
+uint64_t collect_results(kmerhash_entry_s * slots, const uint64_t * high,
+			 uint64_t size, struct result_s ** results,
+			 uint64_t top)
 {
-  fprintf(logfile, "\n");
+  /* the matching kmers, with separate reverse counts if any, sorted,
+     or only the top ones if top > 0 (the others follow unsorted);
+     the slots not in use have a zero count; the upper words of the
+     kmers are in high with k > 32 */
+
+  uint64_t x = 0;
+  for (uint64_t i = 0; i < size; i++)
+    {
+      uint64_t reverse = count_reverse ? count_reverse[i] : 0;
+      if (slots[i].count + reverse > 0)
+	x++;
+    }
+
+  * results = new result_s [x + 1];
+  uint64_t j = 0;
+  for (uint64_t i = 0; i < size; i++)
+    {
+      uint64_t reverse = count_reverse ? count_reverse[i] : 0;
+      if (slots[i].count + reverse > 0)
+	{
+	  (* results)[j].kmer = slots[i].kmer;
+	  (* results)[j].high = high ? high[i] : 0;
+	  (* results)[j].count = slots[i].count + reverse;
+	  (* results)[j].reverse = reverse;
+	  (* results)[j].slot = i;
+	  j++;
+	}
+    }
 
   progress_init("Sorting results:  ", 1);
-  qsort(seqhashtable,
-	seqhashsize,
-	sizeof(struct hashentry),
-	compare_kmers);
+  if ((top > 0) && (top < x))
+    {
+      std::nth_element(* results, * results + top, * results + x,
+		       result_before);
+      sort_results(* results, top);
+    }
+  else
+    sort_results(* results, x);
+  progress_done();
+
+  return x;
+}
+
+char * format_result(char * p, const struct result_s * e)
+{
+  /* one line with a kmer and its counts, at most write_line_max bytes */
+  p = writer_format_kmer(p, e->kmer, e->high, k);
+  * p++ = '\t';
+  p = writer_format_uint(p, e->count);
+  if (strand_counts)
+    {
+      * p++ = '\t';
+      p = writer_format_uint(p, e->count - e->reverse);
+      * p++ = '\t';
+      p = writer_format_uint(p, e->reverse);
+    }
+  * p++ = '\n';
+  return p;
+}
+
+void write_worker(int64_t t)
+{
+  /* format chunk t of the lines from write_first */
+  const uint64_t first = std::min(write_first + static_cast<uint64_t>(t) *
+				  write_chunk, write_last);
+  const uint64_t last = std::min(first + write_chunk, write_last);
+  char * p = write_text[t];
+  for (uint64_t i = first; i < last; i++)
+    p = format_result(p, write_results + i);
+  write_length[t] = static_cast<uint64_t>(p - write_text[t]);
+}
+
+void print_results(struct result_s * results, uint64_t x, uint64_t shown)
+{
+  /*
+    Print the first shown kmers and counts to output file. With many
+    lines, each thread formats a chunk of them, and the chunks are
+    written in order.
+  */
+
+  uint64_t y = 0;
+  for (uint64_t i = 0; i < x; i++)
+    y += results[i].count;
+
+  const int64_t t = (shown > write_chunk) ? opt_threads : 1;
+  const auto chunks = static_cast<uint64_t>(t);
+  write_text = new char * [chunks];
+  write_length = new uint64_t [chunks];
+  for (uint64_t c = 0; c < chunks; c++)
+    write_text[c] = new char [write_chunk * write_line_max];
+  write_results = results;
+  write_last = shown;
+
+  ThreadRunner * write_threads =
+    (t > 1) ? new ThreadRunner(t, write_worker) : nullptr;
+  struct writer_s * w = writer_init(outfile);
+
+  progress_init("Writing results:  ", shown);
+  for (write_first = 0; write_first < shown;
+       write_first += chunks * write_chunk)
+    {
+      if (write_threads)
+	write_threads->run();
+      else
+	write_worker(0);
+      for (uint64_t c = 0; c < chunks; c++)
+	writer_write(w, write_text[c], write_length[c]);
+      progress_update(write_first);
+    }
+  progress_done();
+
+  writer_exit(w);
+  delete write_threads;
+  for (uint64_t c = 0; c < chunks; c++)
+    delete [] write_text[c];
+  delete [] write_text;
+  delete [] write_length;
+  write_text = nullptr;
+  write_length = nullptr;
+
+  fprintf(logfile, "Matching kmers:    %" PRIu64 "\n", x);
+  fprintf(logfile, "Total matches:     %" PRIu64 "\n", y);
+}
+
+void write_binary(struct result_s * results, uint64_t x, uint64_t shown)
+{
+  /* Write the first shown kmers and counts to a binary count file */
+
+  uint64_t y = 0;
+  for (uint64_t i = 0; i < x; i++)
+    y += results[i].count;
+
+  progress_init("Writing results:  ", 1);
+  std::sort(results, results + shown,
+	    [](const struct result_s & a, const struct result_s & b)
+	    { return a.kmer < b.kmer; });
+  uint64_t * kmers = new uint64_t [shown + 1];
+  uint64_t * counts = new uint64_t [shown + 1];
+  uint64_t * reverse = strand_counts ? new uint64_t [shown + 1] : nullptr;
+  for (uint64_t i = 0; i < shown; i++)
+    {
+      kmers[i] = results[i].kmer;
+      counts[i] = results[i].count;
+      if (reverse)
+	reverse[i] = results[i].reverse;
+    }
+  countfile_write(outfile, k, canonical, shown, kmers, counts, reverse);
+  delete [] kmers;
+  delete [] counts;
+  delete [] reverse;
   progress_done();
 
-  /* Print kmers and counts to output file */
-  unsigned int x = 0;
+  fprintf(logfile, "Matching kmers:    %" PRIu64 "\n", x);
+  fprintf(logfile, "Total matches:     %" PRIu64 "\n", y);
+}
+
+void sample_collect(kmerhash_entry_s * slots, uint64_t size,
+		    struct sample_s * sample)
+{
+  /* move the counts of the last sequence file to the sample */
+
+  for (uint64_t i = 0; i < size; i++)
+    {
+      uint64_t reverse = count_reverse ? count_reverse[i] : 0;
+      if (slots[i].count + reverse > 0)
+	{
+	  sample->counts.push_back({i, slots[i].count + reverse, reverse});
+	  slots[i].count = 0;
+	  if (count_reverse)
+	    count_reverse[i] = 0;
+	}
+    }
+}
+
+void sample_totals(kmerhash_entry_s * slots, std::vector<sample_s> & samples)
+{
+  /* put the sums over all samples back into the index */
+
+  for (auto & sample : samples)
+    for (auto & c : sample.counts)
+      {
+	slots[c.slot].count += c.count - c.reverse;
+	if (count_reverse)
+	  count_reverse[c.slot] += c.reverse;
+      }
+}
+
+void print_matrix(struct result_s * results, uint64_t x, uint64_t shown,
+		  uint64_t size, std::vector<sample_s> & samples,
+		  bool matrix_market)
+{
+  /*
+    Print a kmer x sample matrix, with the first shown kmers in the
+    order of the results, either as a table with one column for each
+    sample (three with separate strand counts) or in the Matrix Market
+    coordinate format.
+  */
+
+  const uint64_t n = samples.size();
+
+  /* the row of each matching kmer, the samples sorted by row,
+     without the kmers not shown */
+  uint64_t * rows = new uint64_t [size];
+  for (uint64_t i = 0; i < x; i++)
+    rows[results[i].slot] = i;
+  uint64_t entries = 0;
+  for (auto & sample : samples)
+    {
+      for (auto & c : sample.counts)
+	c.slot = rows[c.slot];
+      sample.counts.erase(std::remove_if(sample.counts.begin(),
+					 sample.counts.end(),
+					 [shown](const sample_count_s & c)
+					 { return c.slot >= shown; }),
+			  sample.counts.end());
+      std::sort(sample.counts.begin(), sample.counts.end(),
+		[](const sample_count_s & a, const sample_count_s & b)
+		{ return a.slot < b.slot; });
+      entries += sample.counts.size();
+    }
+  delete [] rows;
+
   uint64_t y = 0;
-  progress_init("Writing results:  ", seqhashsize);
-  for (uint64_t i = 0; i < seqhashsize; i++)
+  for (uint64_t i = 0; i < x; i++)
+    y += results[i].count;
+
+  progress_init("Writing results:  ", shown);
+
+  struct writer_s * w = nullptr;
+  char * p = nullptr;
+
+  if (matrix_market)
     {
-      struct hashentry * e = seqhashtable + i;
-      if (e->kmer != (uint64_t)-1)
+      /* rows and columns are numbered from 1, their names in comments */
+      fprintf(outfile, "%%%%MatrixMarket matrix coordinate integer general\n");
+      fprintf(outfile, "%% kmercount %s: kmers (rows) x samples (columns)\n",
+	      program_version.c_str());
+      for (uint64_t s = 0; s < n; s++)
+	fprintf(outfile, "%% column %" PRIu64 " %s\n",
+		s + 1, samples[s].name.c_str());
+      w = writer_init(outfile);
+      for (uint64_t i = 0; i < shown; i++)
 	{
-	  if (e->count > 0)
+	  p = writer_reserve(w, writer_uint64_max + writer_kmer_max + 8);
+	  memcpy(p, "% row ", 6);
+	  p = writer_format_uint(p + 6, i + 1);
+	  * p++ = ' ';
+	  p = writer_format_kmer(p, results[i].kmer, results[i].high, k);
+	  * p++ = '\n';
+	  writer_commit(w, p);
+	}
+      p = writer_reserve(w, 3 * (writer_uint64_max + 1));
+      p = writer_format_uint(p, shown);
+      * p++ = ' ';
+      p = writer_format_uint(p, n);
+      * p++ = ' ';
+      p = writer_format_uint(p, entries);
+      * p++ = '\n';
+      writer_commit(w, p);
+      for (uint64_t s = 0; s < n; s++)
+	for (auto & c : samples[s].counts)
 	  {
-	    fprintseq(outfile, e->kmer);
-	    fprintf(outfile,"\t%" PRIu64 "\n", e->count);
-	    x++;
-	    y += e->count;
+	    p = writer_reserve(w, 3 * (writer_uint64_max + 1));
+	    p = writer_format_uint(p, c.slot + 1);
+	    * p++ = ' ';
+	    p = writer_format_uint(p, s + 1);
+	    * p++ = ' ';
+	    p = writer_format_uint(p, c.count);
+	    * p++ = '\n';
+	    writer_commit(w, p);
+	    progress_update(c.slot);
 	  }
-	  else
-	    break;
+    }
+  else
+    {
+      fprintf(outfile, "kmer");
+      for (auto & sample : samples)
+	if (strand_counts)
+	  fprintf(outfile, "\t%s\t%s:fwd\t%s:rev", sample.name.c_str(),
+		  sample.name.c_str(), sample.name.c_str());
+	else
+	  fprintf(outfile, "\t%s", sample.name.c_str());
+      fprintf(outfile, "\n");
+      w = writer_init(outfile);
+
+      /* fill the rows of a block from each sample in turn, then print */
+      static const uint64_t block = 4096;
+      uint64_t * cells = new uint64_t [block * n * 2] { };
+      std::vector<uint64_t> next(n, 0);
+      for (uint64_t first = 0; first < shown; first += block)
+	{
+	  const uint64_t last = std::min(first + block, shown);
+	  for (uint64_t s = 0; s < n; s++)
+	    {
+	      auto & counts = samples[s].counts;
+	      for (; (next[s] < counts.size()) && (counts[next[s]].slot < last);
+		   next[s]++)
+		{
+		  uint64_t * c = cells + ((counts[next[s]].slot - first) * n + s) * 2;
+		  c[0] = counts[next[s]].count;
+		  c[1] = counts[next[s]].reverse;
+		}
+	    }
+	  for (uint64_t i = first; i < last; i++)
+	    {
+	      p = writer_reserve(w, writer_kmer_max + 1);
+	      p = writer_format_kmer(p, results[i].kmer, results[i].high, k);
+	      writer_commit(w, p);
+	      uint64_t * c = cells + (i - first) * n * 2;
+	      for (uint64_t s = 0; s < n; s++, c += 2)
+		{
+		  p = writer_reserve(w, 3 * (writer_uint64_max + 1));
+		  * p++ = '\t';
+		  p = writer_format_uint(p, c[0]);
+		  if (strand_counts)
+		    {
+		      * p++ = '\t';
+		      p = writer_format_uint(p, c[0] - c[1]);
+		      * p++ = '\t';
+		      p = writer_format_uint(p, c[1]);
+		    }
+		  writer_commit(w, p);
+		  c[0] = 0;
+		  c[1] = 0;
+		}
+	      p = writer_reserve(w, 1);
+	      * p++ = '\n';
+	      writer_commit(w, p);
+	      progress_update(i);
+	    }
 	}
-      else
-	break;
-      progress_update(i);
+      delete [] cells;
     }
+
+  writer_exit(w);
   progress_done();
 
-  fprintf(logfile, "Matching kmers:    %u\n", x);
+  fprintf(logfile, "Matching kmers:    %" PRIu64 "\n", x);
   fprintf(logfile, "Total matches:     %" PRIu64 "\n", y);
 }
 
 
-void kmercount(const char * kmer_filename,
-	       const char * seq_filename,
-	       int opt_k)
+unsigned int bloom_auto_bits(uint64_t kmer_count)
 {
-  k = opt_k;
+  /* as many bits per kmer as fit in half the last level cache,
+     but at least 8 and at most 32 */
+
+  static const uint64_t min_bits = 8;
+  static const uint64_t max_bits = 32;
+  static const uint64_t default_cache = 8 << 20;
+
+  uint64_t cache = arch_get_cachesize(3);
+  if (cache == 0)
+    cache = arch_get_cachesize(2);
+  if (cache == 0)
+    cache = default_cache;
+  const uint64_t budget = cache / 2 * 8;
+  const uint64_t bits = kmer_count ? budget / kmer_count : max_bits;
+  return static_cast<unsigned int>(std::min(std::max(bits, min_bits),
+					    max_bits));
+}
 
-  /* Read FASTA with kmers */
-  fprintf(logfile, "Reading kmer file\n");
-  struct db_s * kmer_db = db_read(kmer_filename);
-  unsigned int kmer_count = db_getsequencecount(kmer_db);
+void bloom_show(struct bloomflex_s * bloom, uint64_t unique)
+{
+  /* the size of the Bloom filter and its expected false positive rate */
+  const double bits = 64.0 * bloom->size / std::max(unique, uint64_t { 1 });
+  fprintf(logfile, "Bloom filter:      %.1f MB, %.1f bits per kmer, "
+	  "%" PRIu64 " bits per pattern\n",
+	  8.0 * bloom->size / (1 << 20), bits, bloom->pattern_k);
+  fprintf(logfile, "Expected FP rate:  %.4f%%\n",
+	  100.0 * bloomflex_fpr(bits, bloom->pattern_k));
+}
+
+enum engine_e engine_select(struct kmerindex_s * index,
+			   const std::string & engine)
+{
+  /*
+    Use the Bloom filter unless the parts of the index read by a
+    lookup fit in the level 2 cache. Such an index is fast to search,
+    but still slower than the filter for kmers that are not in it, so
+    the filter is only skipped for batches where nearly all kmers are
+    found anyway (adaptive).
+  */
+
+  static const uint64_t default_cache = 256 << 10;
+
+  uint64_t size = 0;
+  if (index->mphf)
+    size = index->mphf->words_count * sizeof(struct mphf_word_s) +
+      index->mphf->fallback_count * sizeof(uint64_t) +
+      index->mphf->size * sizeof(struct kmerhash_entry_s);
+  else
+    size = index->table->size * (1 + sizeof(struct kmerhash_entry_s) +
+				 (index->table->high ? sizeof(uint64_t) : 0));
+
+  uint64_t cache = arch_get_cachesize(2);
+  if (cache == 0)
+    cache = default_cache;
+
+  enum engine_e e = (size > cache) ? engine_bloom : engine_adaptive;
+  const char * reason = (size > cache) ?
+    "index larger than L2 cache" : "index fits in L2 cache";
+  if (engine != "auto")
+    {
+      e = (engine == "bloom") ? engine_bloom : engine_direct;
+      reason = "as requested";
+    }
+
+  static const char * const names[] =
+    { "Bloom filter + index", "direct index",
+      "adaptive, direct while nearly all kmers match" };
+  fprintf(logfile, "Lookup engine:     %s\n", names[e]);
+  fprintf(logfile, "Engine reason:     %s (%.2f of %.2f MB)\n",
+	  reason, 1.0 * size / (1 << 20), 1.0 * cache / (1 << 20));
+  return e;
+}
+
+/* state shared by the threads loading the kmer file */
+
+static const uint64_t load_batch_size = 1 << 24; /* bytes per batch */
 
-  /* set up Bloom filter, 1 byte per kmer, 4 of 8 bits set */
-  bloomflex_s * bloom = bloomflex_init(kmer_count, 4);
+enum load_phase_e
+  {
+    load_hash,    /* hash the kmers of the batch */
+    load_insert,  /* insert them in the table, and read the next batch */
+    load_bloom    /* set the Bloom filter for the distinct kmers */
+  };
+
+static enum load_phase_e load_phase = load_hash;
+static struct db_stream_s * load_stream = nullptr;
+static struct db_s * load_batches[2] = { nullptr, nullptr };
+static unsigned int load_current = 0;  /* the batch indexed, the other is read */
+static bool load_more = false;
+static uint64_t load_first = 0;  /* where the batch starts in the arrays */
+static std::vector<uint64_t> load_kmers;
+static std::vector<uint64_t> load_rcs;
+static std::vector<uint64_t> load_keys;
+static std::vector<uint64_t> load_hashes;
+static std::vector<kmer_wide_t> load_wide_kmers;  /* instead, with k > 32 */
+static std::vector<kmer_wide_t> load_wide_rcs;
+static std::vector<uint64_t> load_inserted;  /* by each thread */
+static struct kmerhash_s * load_table = nullptr;  /* or the MPHF arrays */
+static struct bloomflex_s * load_filter = nullptr;
+
+template <typename W>
+uint64_t kmer_rehash(struct kmerhash_s * table, uint64_t slot,
+		     W * kmer, W * kmer_rc)
+{
+  /* the kmer in a slot of the table, its reverse complement and hash */
+  kmerhash_load(table, slot, * kmer);
+  * kmer_rc = canonical ? reverse_complement(k, * kmer) : * kmer;
+  return hash_full(k, std::min(* kmer, * kmer_rc));
+}
+
+uint64_t kmer_rehash(struct kmerhash_s * table, uint64_t slot)
+{
+  /* the hash of the kmer in a slot of the table */
+  if (k > 32)
+    {
+      kmer_wide_t kmer;
+      kmer_wide_t kmer_rc;
+      return kmer_rehash(table, slot, & kmer, & kmer_rc);
+    }
+  uint64_t kmer;
+  uint64_t kmer_rc;
+  return kmer_rehash(table, slot, & kmer, & kmer_rc);
+}
+
+void load_worker(int64_t t)
+{
+  /*
+    Thread 0 reads the next batch while the kmers of the current one
+    are inserted, the others share the work. Each kmer is inserted by
+    the thread given by its fingerprint, so the same kmers are always
+    inserted by the same thread in the order of the file, and the
+    kmer stored is the one given first, as with a single thread.
+  */
+
+  const auto workers = static_cast<uint64_t>(opt_threads);
+  if (t == 0)
+    {
+      if (load_phase == load_insert)
+	load_more = db_stream_next(load_stream,
+				   load_batches[1 - load_current],
+				   load_batch_size);
+      return;
+    }
+  const auto w = static_cast<uint64_t>(t - 1);
 
-  /* set up hashtable */
-  const uint64_t seqhashsize = 2 * kmer_count;
-  struct hashentry * seqhashtable = nullptr;
-  seqhashtable = new hashentry [seqhashsize] { };
-  for (uint64_t j = 0; j < seqhashsize; j++)
+  if (load_phase == load_hash)
     {
-      seqhashtable[j].count = 0;
-      seqhashtable[j].kmer = (uint64_t) -1;
+      struct db_s * d = load_batches[load_current];
+      const uint64_t n = db_getsequencecount(d);
+      for(uint64_t i = n * w / workers; i < n * (w + 1) / workers; i++)
+	{
+	  char * seq;
+	  unsigned int seqlen;
+	  db_getsequenceandlength(d, i, & seq, & seqlen);
+	  const uint64_t j = load_first + i;
+	  if (k > 32)
+	    load_hashes[j] = kmer_prepare(seqlen, seq, & load_wide_kmers[j],
+					  & load_wide_rcs[j]);
+	  else
+	    load_hashes[j] = kmer_prepare(seqlen, seq, & load_kmers[j],
+					  & load_rcs[j], & load_keys[j]);
+	}
+    }
+  else if (load_phase == load_insert)
+    {
+      if (load_table == nullptr)
+	return;
+      uint64_t inserted = 0;
+      for(uint64_t i = 0; i < load_hashes.size(); i++)
+	if ((kmerhash_fingerprint(load_hashes[i]) % workers == w) &&
+	    ((k > 32) ?
+	     kmerhash_insert_shared(load_table, load_hashes[i],
+				    load_wide_kmers[i], load_wide_rcs[i]) :
+	     kmerhash_insert_shared(load_table, load_hashes[i],
+				    load_kmers[i], load_rcs[i])))
+	  inserted++;
+      load_inserted[w] = inserted;
+    }
+  else if (load_table != nullptr)
+    {
+      /* from the kmers in the table */
+      const uint64_t n = load_table->size;
+      for(uint64_t i = n * w / workers; i < n * (w + 1) / workers; i++)
+	if (load_table->fingerprints[i] != 0)
+	  bloomflex_set_shared(load_filter, kmer_rehash(load_table, i));
     }
+  else
+    {
+      /* from the hashes of all kmers, repeated or not */
+      const uint64_t n = load_hashes.size();
+      for(uint64_t i = n * w / workers; i < n * (w + 1) / workers; i++)
+	bloomflex_set_shared(load_filter, load_hashes[i]);
+    }
+}
+
+uint64_t load_estimate(uint64_t kmers, uint64_t pos, uint64_t filesize)
+{
+  /*
+    The number of kmers expected in the file, from the number in its
+    first pos bytes. Twice that if the size of the file is unknown.
+  */
+  if (filesize == 0)
+    return 2 * kmers;
+  if (pos >= filesize)
+    return kmers;
+  return static_cast<uint64_t>(1.0 * kmers * filesize / std::max(pos, uint64_t { 1 }));
+}
+
+template <typename W>
+struct kmerhash_s * kmer_table_grow(struct kmerhash_s * table, uint64_t count)
+{
+  /* a larger table with the same kmers, with room for count kmers */
+  struct kmerhash_s * t = kmerhash_init(count, table->high != nullptr);
+  for(uint64_t i = 0; i < table->size; i++)
+    if (table->fingerprints[i] != 0)
+      {
+	W kmer;
+	W kmer_rc;
+	const uint64_t h = kmer_rehash(table, i, & kmer, & kmer_rc);
+	kmerhash_insert(t, h, kmer, kmer_rc);
+      }
+  kmerhash_exit(table);
+  return t;
+}
+
+struct kmerindex_s * kmer_index_build(const char * kmer_filename,
+				      bool use_mphf,
+				      unsigned int bloom_bits,
+				      unsigned int bloom_pattern)
+{
+  /*
+    Read the kmer file in batches, and index the kmers of each batch
+    with all the threads while the next batch is read. The hash table
+    is sized for the number of kmers expected from the size of the
+    file, and grows if there are more. The Bloom filter is set when
+    the number of distinct kmers is known.
+  */
 
-  /* compute hash for all kmers and store them in bloom & hash table */
-  progress_init("Indexing kmers:   ", kmer_count);
-  for(unsigned int i = 0; i < kmer_count; i++)
+  fprintf(logfile, "Reading kmer file\n");
+  load_stream = db_stream_open(kmer_filename, 0, 0);
+  const uint64_t filesize = db_stream_getfilesize(load_stream);
+  load_batches[0] = db_alloc();
+  load_batches[1] = db_alloc();
+  load_current = 0;
+  load_inserted.assign(static_cast<uint64_t>(opt_threads), 0);
+  load_table = nullptr;
+
+  progress_init("Indexing kmers:   ", filesize);
+  load_more = db_stream_next(load_stream, load_batches[0], load_batch_size);
+  if (! use_mphf)
+    load_table =
+      kmerhash_init(load_estimate(db_getsequencecount(load_batches[0]),
+				  db_stream_getpos(load_stream), filesize),
+		    k > 32);
+
+  uint64_t kmer_count = 0;
+  ThreadRunner * load_threads = new ThreadRunner(opt_threads + 1, load_worker);
+  while (load_more)
     {
-      char * seq;
-      unsigned int seqlen;
-      db_getsequenceandlength(kmer_db, i, & seq, & seqlen);
-      kmer_insert(seqlen, seq, bloom, seqhashtable, seqhashsize);
-      progress_update(i);
+      const uint64_t n = db_getsequencecount(load_batches[load_current]);
+      const uint64_t pos = db_stream_getpos(load_stream);
+      kmer_count += n;
+
+      /* the arrays hold the batch, or all kmers for the MPHF */
+      load_first = load_table ? 0 : kmer_count - n;
+      if (k > 32)
+	{
+	  load_wide_kmers.resize(load_first + n);
+	  load_wide_rcs.resize(load_first + n);
+	}
+      else
+	{
+	  load_kmers.resize(load_first + n);
+	  load_rcs.resize(load_first + n);
+	  load_keys.resize(load_first + n);
+	}
+      load_hashes.resize(load_first + n);
+
+      if (load_table && (load_table->entries + n > kmerhash_capacity(load_table)))
+	{
+	  uint64_t count = load_estimate(kmer_count, pos, filesize);
+	  count = std::max(count + count / 8, load_table->entries + n);
+	  load_table = (k > 32) ?
+	    kmer_table_grow<kmer_wide_t>(load_table, count) :
+	    kmer_table_grow<uint64_t>(load_table, count);
+	}
+
+      load_phase = load_hash;
+      load_threads->run();
+      load_phase = load_insert;
+      load_threads->run();
+
+      if (load_table)
+	for(auto inserted : load_inserted)
+	  load_table->entries += inserted;
+      load_current = 1 - load_current;
     }
   progress_done();
+  db_stream_showinfo(load_stream);
+  db_stream_close(load_stream);
+  db_free(load_batches[0]);
+  db_free(load_batches[1]);
+  load_stream = nullptr;
 
-  fprintf(logfile,   "Unique kmers:      %" PRIu64 "\n", unique);
+  struct kmerhash_s * table = load_table;
+  struct mphf_s * mphf = nullptr;
+  uint64_t unique = 0;
 
-  db_free(kmer_db);
+  if (! use_mphf)
+    {
+      unique = table->entries;
+      fprintf(logfile, "Unique kmers:      %" PRIu64 "\n", unique);
+    }
+  else
+    {
+      progress_init("Building MPHF:    ", 1);
+      mphf = mphf_init(load_keys.data(), load_hashes.data(), kmer_count);
+      progress_done();
 
-  fprintf(logfile, "\n");
+      /* store each kmer as first given */
+      std::vector<bool> stored(mphf->size, false);
+      for(uint64_t i = 0; i < kmer_count; i++)
+	{
+	  uint64_t slot = mphf_index(mphf, load_keys[i], load_hashes[i]);
+	  if (! stored[slot])
+	    {
+	      stored[slot] = true;
+	      mphf->slots[slot].kmer = load_kmers[i];
+	    }
+	}
 
-  /* Read FASTA sequence file */
+      unique = mphf->size;
+      fprintf(logfile, "Unique kmers:      %" PRIu64 "\n", unique);
+      fprintf(logfile, "MPHF levels:       %u (%.1f bits per kmer)\n",
+	      mphf->levels,
+	      mphf->size ? 128.0 * mphf->words_count / mphf->size : 0.0);
+    }
+
+  /* set up the Bloom filter, with the bits per kmer and per pattern
+     given, or chosen from the number of kmers and the cache size */
+  if (bloom_bits == 0)
+    bloom_bits = bloom_auto_bits(unique);
+  if (bloom_pattern == 0)
+    bloom_pattern = bloomflex_best_k(bloom_bits);
+  load_filter =
+    bloomflex_init((std::max(unique, uint64_t { 1 }) * bloom_bits + 7) / 8,
+		   bloom_pattern);
+  load_phase = load_bloom;
+  load_threads->run();
+  delete load_threads;
+  bloom_show(load_filter, unique);
+
+  struct bloomflex_s * bloom = load_filter;
+  load_filter = nullptr;
+  load_table = nullptr;
+  std::vector<uint64_t>().swap(load_kmers);
+  std::vector<uint64_t>().swap(load_rcs);
+  std::vector<uint64_t>().swap(load_keys);
+  std::vector<uint64_t>().swap(load_hashes);
+  std::vector<kmer_wide_t>().swap(load_wide_kmers);
+  std::vector<kmer_wide_t>().swap(load_wide_rcs);
+
+  auto * index = static_cast<struct kmerindex_s *>
+    (xmalloc(sizeof(struct kmerindex_s)));
+  index->k = k;
+  index->canonical = canonical;
+  index->bloom = bloom;
+  index->table = table;
+  index->mphf = mphf;
+  index->map = nullptr;
+  index->map_size = 0;
+  index->is_mapped = false;
+  return index;
+}
+
+
+void count_file(const char * seq_filename, int64_t min_quality)
+{
+  /* Read FASTA sequence file in batches while counting */
   fprintf(logfile, "Reading sequence file\n");
-  struct db_s * seq_db = db_read(seq_filename);
-  int seq_count = db_getsequencecount(seq_db);
-  uint64_t seq_nucleotides = db_getnucleotides(seq_db);
-
-  /* Compute hash for all kmers in db and count */
-  progress_init("Counting matches: ", seq_nucleotides);
-  uint64_t nt_processed = 0;
-  for(int i = 0; i < seq_count; i++)
-    {
-      char * seq;
-      unsigned int seqlen;
-      db_getsequenceandlength(seq_db, i, & seq, & seqlen);
-      kmer_check(seqlen, seq, bloom, seqhashtable, seqhashsize);
-      nt_processed += seqlen;
-      progress_update(nt_processed);
+  count_stream = db_stream_open(seq_filename, k - 1, min_quality);
+  if (record_file)
+    db_stream_keepnames(count_stream);
+
+  /* one thread reading, the others counting */
+  const uint64_t batch_count = 2 * opt_threads + 1;
+  count_batch_count = batch_count;
+  count_batches_free = new struct db_s * [batch_count];
+  count_batches_full = new struct db_s * [batch_count];
+  count_serials_full = new uint64_t [batch_count];
+  for(uint64_t i = 0; i < batch_count; i++)
+    count_batches_free[i] = db_alloc();
+  count_free = batch_count;
+  count_full = 0;
+  count_full_first = 0;
+  count_serial_read = 0;
+  count_serial_written = 0;
+  count_eof = false;
+
+  progress_init("Counting matches: ", db_stream_getfilesize(count_stream));
+  ThreadRunner * count_threads = new ThreadRunner(opt_threads + 1, count_worker);
+  count_threads->run();
+  delete count_threads;
+  progress_done();
+
+  if (record_file)
+    record_flush();
+
+  db_stream_showinfo(count_stream);
+  db_stream_close(count_stream);
+  count_stream = nullptr;
+
+  for(uint64_t i = 0; i < batch_count; i++)
+    db_free(count_batches_free[i]);
+  delete [] count_batches_free;
+  delete [] count_batches_full;
+  delete [] count_serials_full;
+  count_batches_free = nullptr;
+  count_batches_full = nullptr;
+  count_serials_full = nullptr;
+}
+
+
+void kmercount(struct Parameters const & parameters)
+{
+  kmer_check_fill<32>::fill();
+
+  /* build the kmer index, or read a prebuilt one */
+  struct kmerindex_s * index = nullptr;
+  if (parameters.opt_index.empty())
+    {
+      k = parameters.opt_k;
+      canonical = parameters.opt_canonical || parameters.opt_strand_counts;
+      index = kmer_index_build(parameters.kmer_filename.c_str(),
+			       parameters.opt_mphf,
+			       static_cast<unsigned int>(parameters.opt_bloom_bits),
+			       static_cast<unsigned int>
+			       (parameters.opt_bloom_pattern));
+    }
+  else
+    {
+      fprintf(logfile, "Reading index file\n");
+      index = kmerindex_read(parameters.opt_index.c_str());
+      k = index->k;
+      canonical = index->canonical;
+      if ((parameters.opt_canonical || parameters.opt_strand_counts) &&
+	  ! canonical)
+	fatal(error_prefix, "The index was built for the forward strand only.\n"
+	      "Build it with --canonical to count both strands.");
+      if ((k > 32) && (parameters.opt_output_format == "binary"))
+	fatal(error_prefix, "The binary output format can only be used "
+	      "with kmers of up to 32 nucleotides.");
+      fprintf(logfile, "Kmer length:       %u\n", k);
+      fprintf(logfile, "Unique kmers:      %" PRIu64 " (%s%s)\n",
+	      index->mphf ? index->mphf->size : index->table->entries,
+	      index->mphf ? "minimal perfect hash" : "hash table",
+	      canonical ? ", both strands" : "");
+      bloom_show(index->bloom,
+		 index->mphf ? index->mphf->size : index->table->entries);
+    }
+
+  if (! parameters.opt_build_index.empty())
+    {
+      fprintf(logfile, "Writing index file\n");
+      kmerindex_write(parameters.opt_build_index.c_str(), index);
+      kmerindex_exit(index);
+      return;
+    }
+
+  count_engine = engine_select(index, parameters.opt_engine);
+  for (unsigned int b = 0; b < 2; b++)
+    count_check[b] = (k > 32) ? kmer_check_wide_table[canonical][b] :
+      kmer_check_table[index->mphf != nullptr][canonical][b][k];
+  kmerhash_entry_s * slots = nullptr;
+  uint64_t * high = nullptr;
+  uint64_t slot_count = 0;
+  if (index->mphf)
+    {
+      count_index = index->mphf;
+      slots = index->mphf->slots;
+      slot_count = index->mphf->size;
+    }
+  else
+    {
+      count_index = index->table;
+      slots = index->table->slots;
+      high = index->table->high;
+      slot_count = index->table->size;
+    }
+
+  strand_counts = parameters.opt_strand_counts;
+  if (strand_counts)
+    count_reverse = new uint64_t [slot_count] { };
+
+  /* count each sequence file in turn, with all threads */
+  const uint64_t n = parameters.seq_filenames.size();
+  const bool matrix = (n > 1) || (parameters.opt_output_format == "mtx");
+  std::vector<sample_s> samples(matrix ? n : 0);
+  count_bloom = index->bloom;
+
+  if (! parameters.opt_per_record.empty())
+    {
+      record_file = fopen_output(parameters.opt_per_record.c_str());
+      if (record_file == nullptr)
+	fatal(error_prefix, "Unable to open per record output file for writing.");
+      record_kmers = parameters.opt_per_record_kmers;
+    }
+
+  for (uint64_t s = 0; s < n; s++)
+    {
+      fprintf(logfile, "\n");
+      if (n > 1)
+	fprintf(logfile, "Sequence file %" PRIu64 " of %" PRIu64 ": %s\n",
+		s + 1, n, parameters.seq_filenames[s].c_str());
+      if (n > 1)
+	record_sample = parameters.sample_names[s].c_str();
+      count_file(parameters.seq_filenames[s].c_str(),
+		 parameters.opt_min_quality);
+      if (matrix)
+	{
+	  samples[s].name = parameters.sample_names[s];
+	  sample_collect(slots, slot_count, & samples[s]);
+	}
+    }
+
+  if (record_file)
+    {
+      fclose(record_file);
+      record_file = nullptr;
+      record_sample = nullptr;
+    }
+
+  /* how many of the kmers not in the index passed the Bloom filter */
+  const struct check_stats_s & direct = count_stats[0];
+  const struct check_stats_s & bloom = count_stats[1];
+  if (direct.kmers + bloom.kmers > 0)
+    {
+      fprintf(logfile, "\n");
+      fprintf(logfile, "Kmers looked up:   %" PRIu64 "\n",
+	      direct.kmers + bloom.kmers);
+      fprintf(logfile, "True hits:         %" PRIu64 "\n",
+	      direct.matches + bloom.matches);
+      if (count_engine == engine_adaptive)
+	fprintf(logfile, "Engine batches:    %" PRIu64 " with Bloom filter, "
+		"%" PRIu64 " direct\n", bloom.batches, direct.batches);
+    }
+  if (bloom.kmers > 0)
+    {
+      const uint64_t false_hits = bloom.bloom_hits - bloom.matches;
+      const uint64_t misses = bloom.kmers - bloom.matches;
+      fprintf(logfile, "Bloom filter hits: %" PRIu64 " of %" PRIu64
+	      " (%.2f%%)\n", bloom.bloom_hits, bloom.kmers,
+	      100.0 * bloom.bloom_hits / bloom.kmers);
+      fprintf(logfile, "False positives:   %" PRIu64 " (%.4f%% of misses)\n",
+	      false_hits, misses ? 100.0 * false_hits / misses : 0.0);
+    }
+  for (auto & c : count_stats)
+    c = { 0, 0, 0, 0 };
+
+  if (matrix)
+    sample_totals(slots, samples);
+
+  fprintf(logfile, "\n");
+  struct result_s * results = nullptr;
+  const auto top = static_cast<uint64_t>(parameters.opt_top);
+  uint64_t x = collect_results(slots, high, slot_count, & results, top);
+  const uint64_t shown = ((top > 0) && (top < x)) ? top : x;
+  if (matrix)
+    print_matrix(results, x, shown, slot_count, samples,
+		 parameters.opt_output_format == "mtx");
+  else if (parameters.opt_output_format == "binary")
+    write_binary(results, x, shown);
+  else
+    print_results(results, x, shown);
+  delete [] results;
+
+  count_index = nullptr;
+  count_bloom = nullptr;
+  delete [] count_reverse;
+  count_reverse = nullptr;
+  strand_counts = false;
+  kmerindex_exit(index);
+}
+
+std::vector<bool> view_select(struct countfile_s * c,
+			      const char * kmer_filename)
+{
+  /*
+    The entries of the count file holding the kmers of a kmer file,
+    found with a binary search, also as their reverse complement if
+    counted on both strands.
+  */
+
+  std::vector<bool> selected(c->entries, false);
+  uint64_t found = 0;
+
+  fprintf(logfile, "Reading kmer file\n");
+  struct db_stream_s * s = db_stream_open(kmer_filename, 0, 0);
+  struct db_s * d = db_alloc();
+  progress_init("Finding kmers:    ", db_stream_getfilesize(s));
+  while (db_stream_next(s, d, load_batch_size))
+    {
+      for (uint64_t i = 0; i < db_getsequencecount(d); i++)
+	{
+	  char * seq;
+	  unsigned int seqlen;
+	  db_getsequenceandlength(d, i, & seq, & seqlen);
+	  uint64_t kmer;
+	  uint64_t kmer_rc;
+	  uint64_t key;
+	  kmer_prepare(seqlen, seq, & kmer, & kmer_rc, & key);
+	  uint64_t e = countfile_find(c, kmer);
+	  if ((e == c->entries) && canonical)
+	    e = countfile_find(c, kmer_rc);
+	  if ((e < c->entries) && ! selected[e])
+	    {
+	      selected[e] = true;
+	      found++;
+	    }
+	}
     }
   progress_done();
+  db_stream_showinfo(s);
+  db_stream_close(s);
+  db_free(d);
+
+  fprintf(logfile, "Kmers found:       %" PRIu64 "\n", found);
+  fprintf(logfile, "\n");
+  return selected;
+}
+
+void kmercount_view(struct Parameters const & parameters)
+{
+  /* print the kmers and counts in a binary count file as text,
+     or only those of a kmer file, if given */
+
+  fprintf(logfile, "Reading count file\n");
+  struct countfile_s * c = countfile_read(parameters.view_filename.c_str());
+  k = c->k;
+  canonical = c->canonical;
+  strand_counts = c->strand_counts;
+  fprintf(logfile, "Kmer length:       %u\n", k);
+  fprintf(logfile, "Counted kmers:     %" PRIu64 "%s\n", c->entries,
+	  strand_counts ? " (with strand counts)" : "");
+  fprintf(logfile, "\n");
+
+  std::vector<bool> selected;
+  if (! parameters.view_kmer_filename.empty())
+    selected = view_select(c, parameters.view_kmer_filename.c_str());
+
+  struct result_s * results = new result_s [c->entries + 1];
+  uint64_t x = 0;
+  for (uint64_t i = 0; i < c->entries; i++)
+    if (selected.empty() || selected[i])
+      {
+	results[x].kmer = c->kmers[i];
+	results[x].high = 0;
+	results[x].count = countfile_count(c, i);
+	results[x].reverse = countfile_reverse(c, i);
+	results[x].slot = x;
+	x++;
+      }
+  countfile_exit(c);
+
+  const auto top = static_cast<uint64_t>(parameters.opt_top);
+  const uint64_t shown = ((top > 0) && (top < x)) ? top : x;
+  progress_init("Sorting results:  ", 1);
+  if (shown < x)
+    std::nth_element(results, results + shown, results + x, result_before);
+  sort_results(results, shown);
+  progress_done();
 
-  print_results(seqhashtable, seqhashsize);
+  print_results(results, x, shown);
+  delete [] results;
 
-  delete [] seqhashtable;
-  seqhashtable = nullptr;
-  bloomflex_exit(bloom);
-  db_free(seq_db);
+  canonical = false;
+  strand_counts = false;
 }
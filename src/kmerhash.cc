@@ -0,0 +1,60 @@
+/*
+    Copyright (C) 2012-2023 Torbjorn Rognes and Frederic Mahe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Torbjorn Rognes <torognes@ifi.uio.no>,
+    Department of Informatics, University of Oslo,
+    PO Box 1080 Blindern, NO-0316 Oslo, Norway
+*/
+
+#include "main.h"
+
+auto kmerhash_init(uint64_t count, bool wide) -> struct kmerhash_s *
+{
+  /* room for count kmers, filling at most 7/8 of the slots,
+     with the upper words of the kmers if wide */
+
+  auto * t = static_cast<struct kmerhash_s *>(xmalloc(sizeof(struct kmerhash_s)));
+
+  const uint64_t slots = count * kmerhash_load_den / kmerhash_load_num + 1;
+  t->buckets = (slots + kmerhash_bucketsize - 1) / kmerhash_bucketsize;
+  t->size = t->buckets * kmerhash_bucketsize;
+  t->entries = 0;
+
+  t->fingerprints = static_cast<unsigned char *>(xmalloc_large(t->size));
+  memset(t->fingerprints, 0, t->size);
+  t->slots = static_cast<struct kmerhash_entry_s *>
+    (xmalloc_large(t->size * sizeof(struct kmerhash_entry_s)));
+  memset(t->slots, 0, t->size * sizeof(struct kmerhash_entry_s));
+
+  t->high = nullptr;
+  if (wide)
+    {
+      t->high = static_cast<uint64_t *>(xmalloc_large(t->size * sizeof(uint64_t)));
+      memset(t->high, 0, t->size * sizeof(uint64_t));
+    }
+
+  return t;
+}
+
+auto kmerhash_exit(struct kmerhash_s * t) -> void
+{
+  xfree_large(t->fingerprints, t->size);
+  xfree_large(t->slots, t->size * sizeof(struct kmerhash_entry_s));
+  if (t->high != nullptr) {
+    xfree_large(t->high, t->size * sizeof(uint64_t));
+  }
+  xfree(t);
+}
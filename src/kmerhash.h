@@ -0,0 +1,328 @@
+/*
+    Copyright (C) 2012-2023 Torbjorn Rognes and Frederic Mahe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Torbjorn Rognes <torognes@ifi.uio.no>,
+    Department of Informatics, University of Oslo,
+    PO Box 1080 Blindern, NO-0316 Oslo, Norway
+*/
+
+/*
+  Hash table of kmers with buckets of 16 slots, in the style of
+  Swiss tables. Each slot has a fingerprint byte, taken from the hash,
+  with zero meaning empty. The 16 fingerprints of a bucket are compared
+  at once with SIMD instructions, and only the kmers of the matching
+  slots are compared. The fingerprints are kept in a separate array
+  from the kmers and their counts, so a lookup usually reads one cache
+  line of fingerprints, and one more for a match.
+  The table is filled to at most 7/8 of the slots.
+
+  Kmers of up to 32 nucleotides are kept in one word. Longer kmers, up
+  to 64 nucleotides, are given as kmer_wide_t, and their upper words
+  are kept in a separate array, high, which is only allocated for
+  them. The functions taking kmers are templates on the kmer type.
+*/
+
+constexpr unsigned int kmerhash_bucketsize {16};
+constexpr uint64_t kmerhash_none {UINT64_MAX};  // slot index for not found
+constexpr uint64_t kmerhash_probe {UINT64_MAX - 1};  // hint: search the buckets
+constexpr uint64_t kmerhash_load_num {7};  // at most 7/8 of the slots in use
+constexpr uint64_t kmerhash_load_den {8};
+
+__extension__ typedef unsigned __int128 kmer_wide_t;
+
+struct kmerhash_entry_s
+{
+  uint64_t kmer;
+  uint64_t count;
+};
+
+struct kmerhash_s
+{
+  uint64_t buckets;  /* number of buckets */
+  uint64_t size;     /* number of slots */
+  uint64_t entries;  /* number of slots in use */
+  unsigned char * fingerprints;
+  struct kmerhash_entry_s * slots;
+  uint64_t * high;   /* upper words of wide kmers, or nullptr */
+};
+
+auto kmerhash_init(uint64_t count, bool wide = false) -> struct kmerhash_s *;
+
+void kmerhash_exit(struct kmerhash_s * t);
+
+inline auto kmerhash_capacity(struct kmerhash_s * t) -> uint64_t
+{
+  /* the number of kmers the table has room for */
+  return t->size / kmerhash_load_den * kmerhash_load_num;
+}
+
+inline auto kmerhash_fingerprint(uint64_t h) -> unsigned char
+{
+  /* bits 16-23 of the hash, not used for the Bloom filter pattern,
+     with zero replaced by one */
+  static constexpr unsigned int fingerprint_shift {16};
+  auto f = static_cast<unsigned char>(h >> fingerprint_shift);
+  return (f == 0) ? 1 : f;
+}
+
+inline auto kmerhash_bucket(struct kmerhash_s * t, uint64_t h) -> uint64_t
+{
+  return arch_fastrange64(h, t->buckets);
+}
+
+/*
+  Bit masks of the slots in a bucket with a given fingerprint. The
+  slot of the lowest bit set is the number of trailing zeros shifted
+  right by kmerhash_match_shift (one bit per slot, or on NEON one bit
+  in each group of four).
+*/
+
+#ifdef __aarch64__
+constexpr unsigned int kmerhash_match_shift {2};
+#else
+constexpr unsigned int kmerhash_match_shift {0};
+#endif
+
+inline auto kmerhash_match(const unsigned char * f, unsigned char x) -> uint64_t
+{
+#if defined __x86_64__
+  const __m128i m = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(f)),
+                                   _mm_set1_epi8(static_cast<char>(x)));
+  return static_cast<uint64_t>(_mm_movemask_epi8(m));
+#elif defined __aarch64__
+  static constexpr uint64_t high_bits {0x8888888888888888};
+  const uint8x16_t m = vceqq_u8(vld1q_u8(f), vdupq_n_u8(x));
+  const uint8x8_t n = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(n), 0) & high_bits;
+#else
+  uint64_t r {0};
+  for(auto i = 0U; i < kmerhash_bucketsize; i++) {
+    if (f[i] == x) {
+      r |= 1ULL << i;
+    }
+  }
+  return r;
+#endif
+}
+
+inline auto kmerhash_slot(uint64_t match) -> unsigned int
+{
+  return static_cast<unsigned int>(__builtin_ctzll(match)) >> kmerhash_match_shift;
+}
+
+/* the kmer in a slot, and storing one */
+
+inline auto kmerhash_load(const struct kmerhash_s * t, uint64_t slot,
+                          uint64_t & kmer) -> void
+{
+  kmer = t->slots[slot].kmer;
+}
+
+inline auto kmerhash_load(const struct kmerhash_s * t, uint64_t slot,
+                          kmer_wide_t & kmer) -> void
+{
+  kmer = (static_cast<kmer_wide_t>(t->high[slot]) << 64U) | t->slots[slot].kmer;
+}
+
+inline auto kmerhash_store(struct kmerhash_s * t, uint64_t slot,
+                           uint64_t kmer) -> void
+{
+  t->slots[slot].kmer = kmer;
+}
+
+inline auto kmerhash_store(struct kmerhash_s * t, uint64_t slot,
+                           kmer_wide_t kmer) -> void
+{
+  t->slots[slot].kmer = static_cast<uint64_t>(kmer);
+  t->high[slot] = static_cast<uint64_t>(kmer >> 64U);
+}
+
+inline void kmerhash_prefetch(struct kmerhash_s * t, uint64_t h)
+{
+  /* start loading the fingerprints of the first bucket */
+  __builtin_prefetch(t->fingerprints + kmerhash_bucket(t, h) * kmerhash_bucketsize);
+}
+
+template <typename W = uint64_t>
+inline auto kmerhash_candidate(struct kmerhash_s * t, uint64_t h) -> uint64_t
+{
+  /*
+    With the fingerprints loaded, find the first slot in the bucket
+    with a matching fingerprint, if any, and start loading its kmer
+    and count. The slot is given as a hint to kmerhash_find. Without
+    a match, the kmer is not in the table if the bucket has an empty
+    slot (kmerhash_none), otherwise the next buckets must be searched
+    (kmerhash_probe).
+  */
+  const uint64_t first = kmerhash_bucket(t, h) * kmerhash_bucketsize;
+  const uint64_t m = kmerhash_match(t->fingerprints + first,
+                                    kmerhash_fingerprint(h));
+  if (m == 0) {
+    return (kmerhash_match(t->fingerprints + first, 0) != 0) ?
+      kmerhash_none : kmerhash_probe;
+  }
+  const uint64_t slot = first + kmerhash_slot(m);
+  __builtin_prefetch(t->slots + slot, 1);
+  if (sizeof(W) > sizeof(uint64_t)) {
+    __builtin_prefetch(t->high + slot);
+  }
+  return slot;
+}
+
+template <typename W>
+inline auto kmerhash_find(struct kmerhash_s * t,
+                          uint64_t h,
+                          W kmer,
+                          W kmer_rc,
+                          uint64_t hint = kmerhash_none) -> uint64_t
+{
+  /*
+    Return the slot holding kmer or kmer_rc, or kmerhash_none.
+    Give kmer_rc equal to kmer to look for the kmer only. The slot
+    in hint, if it is a slot, is checked first.
+  */
+
+  if (hint < t->size)
+    {
+      W x;
+      kmerhash_load(t, hint, x);
+      if ((x == kmer) || (x == kmer_rc)) {
+        return hint;
+      }
+    }
+
+  const unsigned char fingerprint = kmerhash_fingerprint(h);
+  uint64_t bucket = kmerhash_bucket(t, h);
+
+  while (true)
+    {
+      const uint64_t first = bucket * kmerhash_bucketsize;
+      const unsigned char * f = t->fingerprints + first;
+
+      for(uint64_t m = kmerhash_match(f, fingerprint); m != 0; m &= m - 1)
+        {
+          const uint64_t slot = first + kmerhash_slot(m);
+          W x;
+          kmerhash_load(t, slot, x);
+          if ((x == kmer) || (x == kmer_rc)) {
+            return slot;
+          }
+        }
+
+      /* a bucket with an empty slot ends the search */
+      if (kmerhash_match(f, 0) != 0) {
+        return kmerhash_none;
+      }
+
+      bucket++;
+      if (bucket == t->buckets) {
+        bucket = 0;
+      }
+    }
+}
+
+template <typename W>
+inline auto kmerhash_insert(struct kmerhash_s * t,
+                            uint64_t h,
+                            W kmer,
+                            W kmer_rc) -> bool
+{
+  /*
+    Insert kmer with a zero count, unless kmer or kmer_rc is present.
+    Return true if inserted.
+  */
+
+  if (kmerhash_find(t, h, kmer, kmer_rc) != kmerhash_none) {
+    return false;
+  }
+
+  uint64_t bucket = kmerhash_bucket(t, h);
+
+  while (true)
+    {
+      const uint64_t first = bucket * kmerhash_bucketsize;
+      const uint64_t m = kmerhash_match(t->fingerprints + first, 0);
+      if (m != 0)
+        {
+          const uint64_t slot = first + kmerhash_slot(m);
+          t->fingerprints[slot] = kmerhash_fingerprint(h);
+          kmerhash_store(t, slot, kmer);
+          t->slots[slot].count = 0;
+          t->entries++;
+          return true;
+        }
+
+      bucket++;
+      if (bucket == t->buckets) {
+        bucket = 0;
+      }
+    }
+}
+
+template <typename W>
+inline auto kmerhash_insert_shared(struct kmerhash_s * t,
+                                   uint64_t h,
+                                   W kmer,
+                                   W kmer_rc) -> bool
+{
+  /*
+    Insert as kmerhash_insert, while other threads insert other
+    kmers. An empty slot is taken by setting its fingerprint
+    atomically. All kmers with the same fingerprint must be inserted
+    by the same thread, so that the slots found with the fingerprint
+    of kmer are complete. The entries are counted by the caller.
+
+    The fingerprints are read by kmerhash_find with plain SIMD loads
+    while other threads set other bytes of the same buckets. This is
+    only safe because of that ownership: a thread only matches
+    fingerprints it wrote itself, so the kmers it then reads were
+    stored by the same thread, and a byte set by another thread can
+    only turn an empty slot into a non-matching one, which at most
+    sends the search on to the next bucket. Inserting kmers with the
+    same fingerprint from several threads would be a data race.
+  */
+
+  if (kmerhash_find(t, h, kmer, kmer_rc) != kmerhash_none) {
+    return false;
+  }
+
+  const unsigned char fingerprint = kmerhash_fingerprint(h);
+  uint64_t bucket = kmerhash_bucket(t, h);
+
+  while (true)
+    {
+      const uint64_t first = bucket * kmerhash_bucketsize;
+      for(uint64_t m = kmerhash_match(t->fingerprints + first, 0); m != 0; m &= m - 1)
+        {
+          const uint64_t slot = first + kmerhash_slot(m);
+          unsigned char empty {0};
+          if (__atomic_compare_exchange_n(t->fingerprints + slot, & empty,
+                                          fingerprint, false,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+              kmerhash_store(t, slot, kmer);
+              t->slots[slot].count = 0;
+              return true;
+            }
+        }
+
+      /* the bucket is full, or was filled by other threads */
+      bucket++;
+      if (bucket == t->buckets) {
+        bucket = 0;
+      }
+    }
+}
@@ -0,0 +1,376 @@
+/*
+    Copyright (C) 2012-2023 Torbjorn Rognes and Frederic Mahe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Torbjorn Rognes <torognes@ifi.uio.no>,
+    Department of Informatics, University of Oslo,
+    PO Box 1080 Blindern, NO-0316 Oslo, Norway
+*/
+
+
+#include "main.h"
+
+static constexpr char kmerindex_magic[8] {'K', 'M', 'C', 'I', 'N', 'D', 'E', 'X'};
+static constexpr uint32_t kmerindex_byteorder {0x01020304};
+static constexpr uint64_t kmerindex_align {4096};
+static constexpr uint32_t kmerindex_flag_canonical {1};
+static constexpr uint32_t kmerindex_flag_mphf {2};
+
+enum kmerindex_section
+  {
+    kmerindex_bloom_bitmap,
+    kmerindex_table_fingerprints,
+    kmerindex_slots,
+    kmerindex_table_high,
+    kmerindex_mphf_words,
+    kmerindex_mphf_fallback,
+    kmerindex_sections
+  };
+
+struct kmerindex_header_s
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byteorder;
+  uint32_t k;
+  uint32_t flags;
+  uint64_t bloom_size;
+  uint64_t bloom_pattern_k;
+  uint64_t table_buckets;
+  uint64_t table_entries;
+  uint64_t mphf_size;
+  uint64_t mphf_levels;
+  uint64_t mphf_level_offset[mphf_max_levels];
+  uint64_t mphf_level_bits[mphf_max_levels];
+  uint64_t mphf_words_count;
+  uint64_t mphf_fallback_first;
+  uint64_t mphf_fallback_count;
+  uint64_t section_offset[kmerindex_sections];
+  uint64_t section_size[kmerindex_sections];
+};
+
+auto kmerindex_sizes(struct kmerindex_header_s * h) -> bool
+{
+  /* the size in bytes of each array, from the parameters,
+     false if any of them overflows */
+
+  const bool mphf = (h->flags & kmerindex_flag_mphf) != 0;
+  uint64_t slots = h->mphf_size;
+  bool overflow = (! mphf) &&
+    __builtin_mul_overflow(h->table_buckets, kmerhash_bucketsize, & slots);
+
+  auto size = [&](bool used, uint64_t count, uint64_t bytes) -> uint64_t
+    {
+      uint64_t result {0};
+      if (used) {
+        overflow = __builtin_mul_overflow(count, bytes, & result) || overflow;
+      }
+      return result;
+    };
+
+  h->section_size[kmerindex_bloom_bitmap] =
+    size(true, h->bloom_size, sizeof(uint64_t));
+  h->section_size[kmerindex_table_fingerprints] = size(! mphf, slots, 1);
+  h->section_size[kmerindex_slots] =
+    size(true, slots, sizeof(struct kmerhash_entry_s));
+  h->section_size[kmerindex_table_high] =
+    size((! mphf) && (h->k > 32), slots, sizeof(uint64_t));
+  h->section_size[kmerindex_mphf_words] =
+    size(mphf, h->mphf_words_count, sizeof(struct mphf_word_s));
+  h->section_size[kmerindex_mphf_fallback] =
+    size(mphf, h->mphf_fallback_count, sizeof(uint64_t));
+
+  return ! overflow;
+}
+
+auto kmerindex_check_mphf(const struct kmerindex_header_s * h) -> bool
+{
+  /* the levels lie within the words, and the keys left after them
+     within the slots */
+
+  if ((h->mphf_levels == 0) || (h->mphf_size == 0) ||
+      (h->mphf_fallback_first > h->mphf_size) ||
+      (h->mphf_fallback_count > h->mphf_size - h->mphf_fallback_first)) {
+    return false;
+  }
+  for(auto i = 0U; i < h->mphf_levels; i++)
+    {
+      const uint64_t words = h->mphf_level_bits[i] / 64;
+      if ((h->mphf_level_bits[i] == 0) || (h->mphf_level_bits[i] % 64 != 0) ||
+          (h->mphf_level_offset[i] > h->mphf_words_count) ||
+          (words > h->mphf_words_count - h->mphf_level_offset[i])) {
+        return false;
+      }
+    }
+  return true;
+}
+
+auto kmerindex_write(const char * filename, struct kmerindex_s * x) -> void
+{
+  struct kmerindex_header_s h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, kmerindex_magic, sizeof(h.magic));
+  h.version = kmerindex_version;
+  h.byteorder = kmerindex_byteorder;
+  h.k = x->k;
+  h.flags = (x->canonical ? kmerindex_flag_canonical : 0) |
+    ((x->mphf != nullptr) ? kmerindex_flag_mphf : 0);
+  h.bloom_size = x->bloom->size;
+  h.bloom_pattern_k = x->bloom->pattern_k;
+
+  const void * data[kmerindex_sections] {nullptr};
+  data[kmerindex_bloom_bitmap] = x->bloom->bitmap;
+
+  if (x->mphf != nullptr)
+    {
+      struct mphf_s * m = x->mphf;
+      h.mphf_size = m->size;
+      h.mphf_levels = m->levels;
+      for(auto i = 0U; i < m->levels; i++)
+        {
+          h.mphf_level_offset[i] = m->level_offset[i];
+          h.mphf_level_bits[i] = m->level_bits[i];
+        }
+      h.mphf_words_count = m->words_count;
+      h.mphf_fallback_first = m->fallback_first;
+      h.mphf_fallback_count = m->fallback_count;
+      data[kmerindex_slots] = m->slots;
+      data[kmerindex_mphf_words] = m->words;
+      data[kmerindex_mphf_fallback] = m->fallback_keys;
+    }
+  else
+    {
+      h.table_buckets = x->table->buckets;
+      h.table_entries = x->table->entries;
+      data[kmerindex_table_fingerprints] = x->table->fingerprints;
+      data[kmerindex_slots] = x->table->slots;
+      data[kmerindex_table_high] = x->table->high;
+    }
+
+  /* each array at a page boundary after the header */
+
+  (void) kmerindex_sizes(&h);
+  uint64_t offset = sizeof(h);
+  for(auto i = 0U; i < kmerindex_sections; i++)
+    {
+      offset = (offset + kmerindex_align - 1) / kmerindex_align * kmerindex_align;
+      h.section_offset[i] = offset;
+      offset += h.section_size[i];
+    }
+
+  std::FILE * fp = fopen_output(filename);
+  if (fp == nullptr) {
+    fatal(error_prefix, "Unable to open index file for writing.");
+  }
+
+  static const char zeros[kmerindex_align] {0};
+  bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+  uint64_t written = sizeof(h);
+  for(auto i = 0U; ok && (i < kmerindex_sections); i++)
+    {
+      const uint64_t padding = h.section_offset[i] - written;
+      if (padding > 0) {
+        ok = fwrite(zeros, 1, padding, fp) == padding;
+      }
+      if (ok && (h.section_size[i] > 0)) {
+        ok = fwrite(data[i], 1, h.section_size[i], fp) == h.section_size[i];
+      }
+      written = h.section_offset[i] + h.section_size[i];
+    }
+
+  if ((fclose(fp) != 0) || ! ok) {
+    fatal(error_prefix, "Unable to write index file.");
+  }
+}
+
+auto kmerindex_load(const char * filename, struct kmerindex_s * x) -> void
+{
+  /* map the file, or read it into memory where it cannot be mapped */
+
+  std::FILE * fp = fopen_input(filename);
+  if (fp == nullptr) {
+    fatal(error_prefix, "Unable to open index file for reading.");
+  }
+
+  struct stat fs;
+  if ((fstat(fileno(fp), & fs) != 0) || ! S_ISREG(fs.st_mode)) {
+    fatal(error_prefix, "The index file must be a regular file.");
+  }
+  x->map_size = static_cast<uint64_t>(fs.st_size);
+  if (x->map_size < sizeof(struct kmerindex_header_s)) {
+    fatal(error_prefix, "The index file is too short.");
+  }
+
+  x->map = nullptr;
+  x->is_mapped = false;
+
+#ifndef _WIN32
+  void * map = mmap(nullptr, x->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fileno(fp), 0);
+  if (map != MAP_FAILED)
+    {
+      x->map = map;
+      x->is_mapped = true;
+    }
+#endif
+
+  if (! x->is_mapped)
+    {
+      x->map = xmalloc(x->map_size);
+      if (fread(x->map, 1, x->map_size, fp) != x->map_size) {
+        fatal(error_prefix, "Unable to read index file.");
+      }
+    }
+
+  fclose(fp);
+}
+
+auto kmerindex_read(const char * filename) -> struct kmerindex_s *
+{
+  auto * x = static_cast<struct kmerindex_s *>(xmalloc(sizeof(struct kmerindex_s)));
+  kmerindex_load(filename, x);
+
+  /* check the header */
+
+  struct kmerindex_header_s h;
+  memcpy(&h, x->map, sizeof(h));
+
+  if (memcmp(h.magic, kmerindex_magic, sizeof(h.magic)) != 0) {
+    fatal(error_prefix, "The file ", filename, " is not a kmercount index.");
+  }
+  if (h.byteorder != kmerindex_byteorder) {
+    fatal(error_prefix, "The index file was written on a machine with another byte order.");
+  }
+  if (h.version != kmerindex_version) {
+    fatal(error_prefix, "The index file has version ", h.version,
+          ", but this program reads version ", kmerindex_version, ".\n"
+          "Please build the index again.");
+  }
+
+  const struct kmerindex_header_s given = h;
+  const bool mphf = (h.flags & kmerindex_flag_mphf) != 0;
+  bool ok = kmerindex_sizes(&h) && (h.k >= 1) && (h.k <= 64) &&
+    ((h.k <= 32) || ! mphf) &&
+    (h.mphf_levels <= mphf_max_levels) &&
+    (h.bloom_size > 0) && (h.bloom_pattern_k >= 1) &&
+    (h.bloom_pattern_k <= bloomflex_max_k) &&
+    (mphf ? kmerindex_check_mphf(&h) : (h.table_buckets > 0));
+  for(auto i = 0U; i < kmerindex_sections; i++)
+    {
+      ok = ok && (h.section_size[i] == given.section_size[i]) &&
+        (h.section_offset[i] <= x->map_size) &&
+        (h.section_size[i] <= x->map_size - h.section_offset[i]) &&
+        (h.section_offset[i] % sizeof(uint64_t) == 0);
+    }
+  if (ok && ! mphf)
+    {
+      /* a lookup ends at a bucket with an empty slot, so the table
+         must be within the load limit and have one */
+      const uint64_t slots = h.table_buckets * kmerhash_bucketsize;
+      ok = (h.table_entries <= slots / kmerhash_load_den * kmerhash_load_num) &&
+        (memchr(static_cast<char *>(x->map) +
+                h.section_offset[kmerindex_table_fingerprints], 0, slots) != nullptr);
+    }
+  if (! ok) {
+    fatal(error_prefix, "The index file is damaged.");
+  }
+
+  /* the structures point to the arrays in the file */
+
+  auto * base = static_cast<char *>(x->map);
+  auto section = [&](enum kmerindex_section s) -> void *
+    { return base + h.section_offset[s]; };
+
+  x->k = h.k;
+  x->canonical = (h.flags & kmerindex_flag_canonical) != 0;
+
+  auto * b = bloomflex_create(h.bloom_size,
+                              static_cast<unsigned int>(h.bloom_pattern_k));
+  b->bitmap = static_cast<uint64_t *>(section(kmerindex_bloom_bitmap));
+  x->bloom = b;
+
+  x->table = nullptr;
+  x->mphf = nullptr;
+  auto * slots = static_cast<struct kmerhash_entry_s *>(section(kmerindex_slots));
+
+  if ((h.flags & kmerindex_flag_mphf) != 0)
+    {
+      auto * m = static_cast<struct mphf_s *>(xmalloc(sizeof(struct mphf_s)));
+      m->size = h.mphf_size;
+      m->levels = static_cast<unsigned int>(h.mphf_levels);
+      for(auto i = 0U; i < m->levels; i++)
+        {
+          m->level_offset[i] = h.mphf_level_offset[i];
+          m->level_bits[i] = h.mphf_level_bits[i];
+        }
+      m->words_count = h.mphf_words_count;
+      m->words = static_cast<struct mphf_word_s *>(section(kmerindex_mphf_words));
+      m->fallback_first = h.mphf_fallback_first;
+      m->fallback_count = h.mphf_fallback_count;
+      m->fallback_keys = static_cast<uint64_t *>(section(kmerindex_mphf_fallback));
+      m->slots = slots;
+      x->mphf = m;
+    }
+  else
+    {
+      auto * t = static_cast<struct kmerhash_s *>(xmalloc(sizeof(struct kmerhash_s)));
+      t->buckets = h.table_buckets;
+      t->size = h.table_buckets * kmerhash_bucketsize;
+      t->entries = h.table_entries;
+      t->fingerprints =
+        static_cast<unsigned char *>(section(kmerindex_table_fingerprints));
+      t->slots = slots;
+      t->high = (h.k > 32) ?
+        static_cast<uint64_t *>(section(kmerindex_table_high)) : nullptr;
+      x->table = t;
+    }
+
+  return x;
+}
+
+auto kmerindex_exit(struct kmerindex_s * x) -> void
+{
+  if (x->map == nullptr)
+    {
+      /* built here, the structures own their arrays */
+      bloomflex_exit(x->bloom);
+      if (x->table != nullptr) {
+        kmerhash_exit(x->table);
+      }
+      if (x->mphf != nullptr) {
+        mphf_exit(x->mphf);
+      }
+    }
+  else
+    {
+      xfree(x->bloom);
+      if (x->table != nullptr) {
+        xfree(x->table);
+      }
+      if (x->mphf != nullptr) {
+        xfree(x->mphf);
+      }
+#ifndef _WIN32
+      if (x->is_mapped) {
+        munmap(x->map, x->map_size);
+      }
+      else
+#endif
+        {
+          xfree(x->map);
+        }
+    }
+  xfree(x);
+}
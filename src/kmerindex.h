@@ -0,0 +1,56 @@
+/*
+    Copyright (C) 2012-2023 Torbjorn Rognes and Frederic Mahe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Torbjorn Rognes <torognes@ifi.uio.no>,
+    Department of Informatics, University of Oslo,
+    PO Box 1080 Blindern, NO-0316 Oslo, Norway
+*/
+
+/*
+  Prebuilt kmer index, with the Bloom filter and the hash table or
+  MPHF, saved to a file once and then mapped into memory when
+  counting, instead of being built again from the kmer file.
+
+  The file starts with a header giving the version, the parameters
+  and the position of each array, followed by the arrays, each at a
+  page boundary. The arrays are used where they are mapped. The
+  mapping is private, so the pages are shared by all processes using
+  the same index file, except the pages of kmers and counts that get
+  a count, which are copied on the first write.
+
+  The file is written in the byte order of the machine, and must be
+  read on a machine with the same byte order.
+*/
+
+constexpr uint32_t kmerindex_version {3};
+
+struct kmerindex_s
+{
+  unsigned int k;
+  bool canonical;
+  struct bloomflex_s * bloom;
+  struct kmerhash_s * table;  /* either the hash table */
+  struct mphf_s * mphf;       /* or the MPHF */
+  void * map;                 /* the file contents, if read from a file */
+  uint64_t map_size;
+  bool is_mapped;             /* mapped, or else read into memory */
+};
+
+void kmerindex_write(const char * filename, struct kmerindex_s * x);
+
+auto kmerindex_read(const char * filename) -> struct kmerindex_s *;
+
+void kmerindex_exit(struct kmerindex_s * x);
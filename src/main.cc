@@ -38,16 +38,30 @@ std::FILE * logfile {stderr};  // cstdio stderr macro is expanded to type std::F
 constexpr int n_options {26};
 std::array<int, n_options> used_options {{0}};  // set int values to zero by default
 
-char short_options[] = "hk:l:o:t:v"; /* unused: abcdefgijmnpqrsuwxyz*/
+char short_options[] = "ab:ce:f:g:hi:k:l:mn:o:p:q:r:st:vx:"; /* unused: djuwyz*/
 
 static struct option long_options[] =
   {
+   {"per-record-kmers",      no_argument,       nullptr, 'a' },
+   {"build-index",           required_argument, nullptr, 'b' },
+   {"canonical",             no_argument,       nullptr, 'c' },
+   {"bloom-bits",            required_argument, nullptr, 'e' },
+   {"manifest",              required_argument, nullptr, 'f' },
+   {"engine",                required_argument, nullptr, 'g' },
    {"help",                  no_argument,       nullptr, 'h' },
+   {"index",                 required_argument, nullptr, 'i' },
    {"kmer-length",           required_argument, nullptr, 'k' },
    {"log",                   required_argument, nullptr, 'l' },
+   {"mphf",                  no_argument,       nullptr, 'm' },
+   {"top",                   required_argument, nullptr, 'n' },
    {"output",                required_argument, nullptr, 'o' },
+   {"bloom-k",               required_argument, nullptr, 'p' },
+   {"min-quality",           required_argument, nullptr, 'q' },
+   {"per-record",            required_argument, nullptr, 'r' },
+   {"strand-counts",         no_argument,       nullptr, 's' },
    {"threads",               required_argument, nullptr, 't' },
    {"version",               no_argument,       nullptr, 'v' },
+   {"output-format",         required_argument, nullptr, 'x' },
    {nullptr,                 0,                 nullptr, 0 }
   };
 
@@ -60,17 +74,34 @@ const std::vector<std::string> header_message
 const std::vector<std::string> args_usage_message
   /*0         1         2         3         4         5         6         7          */
   /*01234567890123456789012345678901234567890123456789012345678901234567890123456789 */
-  {"Usage: kmercount [OPTIONS] KMERFILENAME [SEQUENCEFILENAME]\n",
+  {"Usage: kmercount [OPTIONS] KMERFILENAME [SEQUENCEFILENAME...]\n",
+   "       kmercount [OPTIONS] --build-index INDEXFILENAME KMERFILENAME\n",
+   "       kmercount [OPTIONS] --index INDEXFILENAME [SEQUENCEFILENAME...]\n",
+   "       kmercount [OPTIONS] view COUNTFILENAME [KMERFILENAME]\n",
    "\n",
    "General options:\n",
    " -h, --help                 display this help and exit\n",
-   " -k, --kmer-length INTEGER  kmer length [1-32] (31)\n",
-   " -t, --threads INTEGER      number of threads to use [1-1] (1)\n",
+   " -k, --kmer-length INTEGER  kmer length [1-64] (31)\n",
+   " -c, --canonical            count kmers on both strands\n",
+   " -s, --strand-counts        count both strands, report them separately\n",
+   " -m, --mphf                 index kmers with a minimal perfect hash function\n",
+   " -e, --bloom-bits INTEGER   Bloom filter bits per kmer [1-64] (auto)\n",
+   " -p, --bloom-k INTEGER      Bloom filter bits set per kmer [1-16] (auto)\n",
+   " -g, --engine STRING        lookup engine: auto, bloom or direct (auto)\n",
+   " -t, --threads INTEGER      number of threads to use [1-256] (1)\n",
    " -v, --version              display version information and exit\n",
    "\n",
    "Input/output options:\n",
    " -l, --log FILENAME         log to file (stderr)\n",
    " -o, --output FILENAME      output result to file (stdout)\n",
+   " -x, --output-format STRING output format: tsv, mtx or binary (tsv)\n",
+   " -n, --top INTEGER          output only the most frequent kmers (all)\n",
+   " -f, --manifest FILENAME    file with sequence file names, one per line\n",
+   " -r, --per-record FILENAME  output matches of each sequence to file\n",
+   " -a, --per-record-kmers     list the matching kmers with --per-record\n",
+   " -q, --min-quality INTEGER  min. base quality in fastq input [0-93] (0)\n",
+   " -b, --build-index FILENAME write the kmer index to file, no counting\n",
+   " -i, --index FILENAME       read a prebuilt kmer index instead of kmer file\n",
    "\n"
   };
 
@@ -79,6 +110,7 @@ void args_show();
 void show(const std::vector<std::string> & message);
 void args_init(int argc, char **argv, std::array<int, n_options> & used_options);
 void args_check(std::array<int, n_options> & used_options);
+void read_manifest(const char * filename);
 void open_files();
 void close_files();
 
@@ -103,10 +135,64 @@ int64_t args_long(char * str, const char * option)
 
 void args_show()
 {
-  fprintf(logfile, "Kmer file:         %s\n", p.kmer_filename.c_str());
-  fprintf(logfile, "Sequence file:     %s\n", p.seq_filename.c_str());
-  fprintf(logfile, "Kmer length:       %" PRId64 "\n", p.opt_k);
-  fprintf(logfile, "Output file:       %s\n", p.opt_output_file.c_str());
+  if (p.opt_view) {
+    fprintf(logfile, "Count file:        %s\n", p.view_filename.c_str());
+    if (! p.view_kmer_filename.empty()) {
+      fprintf(logfile, "Kmer file:         %s\n", p.view_kmer_filename.c_str());
+    }
+    fprintf(logfile, "Output file:       %s\n", p.opt_output_file.c_str());
+    if (p.opt_top > 0) {
+      fprintf(logfile, "Top kmers:         %" PRId64 "\n", p.opt_top);
+    }
+  }
+  else if (! p.opt_build_index.empty()) {
+    fprintf(logfile, "Kmer file:         %s\n", p.kmer_filename.c_str());
+    fprintf(logfile, "Kmer length:       %" PRId64 "\n", p.opt_k);
+    fprintf(logfile, "Index file:        %s (output)\n", p.opt_build_index.c_str());
+  }
+  else {
+    if (! p.opt_index.empty()) {
+      fprintf(logfile, "Index file:        %s\n", p.opt_index.c_str());
+    }
+    else {
+      fprintf(logfile, "Kmer file:         %s\n", p.kmer_filename.c_str());
+    }
+    if (p.seq_filenames.size() == 1) {
+      fprintf(logfile, "Sequence file:     %s\n", p.seq_filenames[0].c_str());
+    }
+    else {
+      fprintf(logfile, "Sequence files:    %zu\n", p.seq_filenames.size());
+    }
+    if (p.opt_index.empty()) {
+      fprintf(logfile, "Kmer length:       %" PRId64 "\n", p.opt_k);
+    }
+    fprintf(logfile, "Output file:       %s\n", p.opt_output_file.c_str());
+    if (! p.opt_per_record.empty()) {
+      fprintf(logfile, "Per record file:   %s%s\n", p.opt_per_record.c_str(),
+              p.opt_per_record_kmers ? " (with kmers)" : "");
+    }
+    if (p.opt_top > 0) {
+      fprintf(logfile, "Top kmers:         %" PRId64 "\n", p.opt_top);
+    }
+    if (p.opt_output_format != "tsv") {
+      fprintf(logfile, "Output format:     %s\n", p.opt_output_format.c_str());
+    }
+  }
+  if (p.opt_min_quality > 0) {
+    fprintf(logfile, "Min. quality:      %" PRId64 "\n", p.opt_min_quality);
+  }
+  if (p.opt_canonical || p.opt_strand_counts) {
+    fprintf(logfile, "Strands:           both%s\n",
+            p.opt_strand_counts ? ", counted separately" : "");
+  }
+  if (p.opt_mphf) {
+    fprintf(logfile, "Kmer index:        minimal perfect hash\n");
+  }
+  if ((p.opt_bloom_bits > 0) || (p.opt_bloom_pattern > 0)) {
+    fprintf(logfile, "Bloom filter:      %s bits per kmer, %s bits per pattern\n",
+            p.opt_bloom_bits ? std::to_string(p.opt_bloom_bits).c_str() : "auto",
+            p.opt_bloom_pattern ? std::to_string(p.opt_bloom_pattern).c_str() : "auto");
+  }
   fprintf(logfile, "Threads:           %" PRId64 "\n", opt_threads);
   fprintf(logfile, "\n");
 }
@@ -163,11 +249,46 @@ void args_init(int argc, char **argv, std::array<int, n_options> & used_options)
 
     switch(c)
       {
+      case 'a':
+        /* per-record-kmers */
+        p.opt_per_record_kmers = true;
+        break;
+
+      case 'b':
+        /* build-index */
+        p.opt_build_index = optarg;
+        break;
+
+      case 'c':
+        /* canonical */
+        p.opt_canonical = true;
+        break;
+
+      case 'e':
+        /* bloom-bits */
+        p.opt_bloom_bits = args_long(optarg, "-e or --bloom-bits");
+        break;
+
+      case 'f':
+        /* manifest */
+        p.opt_manifest = optarg;
+        break;
+
+      case 'g':
+        /* engine */
+        p.opt_engine = optarg;
+        break;
+
       case 'h':
         /* help */
         p.opt_help = true;
         break;
 
+      case 'i':
+        /* index */
+        p.opt_index = optarg;
+        break;
+
       case 'k':
         /* kmer-length */
         p.opt_k = args_long(optarg, "-k or --kmer-length");
@@ -178,11 +299,41 @@ void args_init(int argc, char **argv, std::array<int, n_options> & used_options)
         opt_log = optarg;
         break;
 
+      case 'm':
+        /* mphf */
+        p.opt_mphf = true;
+        break;
+
+      case 'n':
+        /* top */
+        p.opt_top = args_long(optarg, "-n or --top");
+        break;
+
       case 'o':
         /* output-file */
         p.opt_output_file = optarg;
         break;
 
+      case 'p':
+        /* bloom-k */
+        p.opt_bloom_pattern = args_long(optarg, "-p or --bloom-k");
+        break;
+
+      case 'q':
+        /* min-quality */
+        p.opt_min_quality = args_long(optarg, "-q or --min-quality");
+        break;
+
+      case 'r':
+        /* per-record */
+        p.opt_per_record = optarg;
+        break;
+
+      case 's':
+        /* strand-counts */
+        p.opt_strand_counts = true;
+        break;
+
       case 't':
         /* threads */
         opt_threads = args_long(optarg, "-t or --threads");
@@ -193,6 +344,11 @@ void args_init(int argc, char **argv, std::array<int, n_options> & used_options)
         p.opt_version = true;
         break;
 
+      case 'x':
+        /* output-format */
+        p.opt_output_format = optarg;
+        break;
+
       default:
         show(header_message);
         show(args_usage_message);
@@ -200,35 +356,236 @@ void args_init(int argc, char **argv, std::array<int, n_options> & used_options)
     }
   }
 
-  if (optind < argc)
+  /* kmercount view COUNTFILENAME [KMERFILENAME] prints a binary count
+     file as text, or only the kmers of the kmer file */
+
+  if ((optind < argc) && (strcmp(argv[optind], "view") == 0) &&
+      p.opt_index.empty() && p.opt_build_index.empty())
     {
-      if (optind + 1 < argc)
+      p.opt_view = true;
+      optind++;
+      if (optind < argc)
 	{
-	  p.kmer_filename = argv[optind];
-	  p.seq_filename = argv[optind + 1];
+	  p.view_filename = argv[optind];
+	  optind++;
 	}
-      else
+      else if (! (p.opt_version || p.opt_help))
 	{
-	  p.kmer_filename = argv[optind];
+	  fprintf(stderr, "No count filename given.\n\n");
+	  p.opt_help = true;
+	}
+      if (optind < argc)
+	{
+	  p.view_kmer_filename = argv[optind];
+	  optind++;
+	}
+      if (optind < argc)
+	{
+	  fatal(error_prefix, "Only one count file can be viewed.");
 	}
+      return;
     }
-  else
+
+  /* the kmers are in the index, if given, otherwise in the first file */
+
+  if (p.opt_index.empty())
     {
-      if (! (p.opt_version || p.opt_help))
+      if (optind < argc)
+	{
+	  p.kmer_filename = argv[optind];
+	  optind++;
+	}
+      else if (! (p.opt_version || p.opt_help))
 	{
 	  fprintf(stderr, "No kmer filename given.\n\n");
 	  // No positional arguments, and neither -v nor -h: show help
 	  p.opt_help = true;
 	}
     }
+
+  for (; optind < argc; optind++)
+    {
+      p.seq_filenames.emplace_back(argv[optind]);
+      p.sample_names.emplace_back(argv[optind]);
+    }
+
+  if (! p.opt_manifest.empty())
+    {
+      read_manifest(p.opt_manifest.c_str());
+    }
+
+  /* standard input, unless only building an index */
+
+  if (p.seq_filenames.empty() && p.opt_build_index.empty())
+    {
+      p.seq_filenames.emplace_back(1, dash_filename);
+      p.sample_names.emplace_back(1, dash_filename);
+    }
+}
+
+
+void read_manifest(const char * filename)
+{
+  /*
+    Sequence file names, one per line, optionally preceded by a sample
+    name and a tab. Empty lines and lines starting with # are skipped.
+  */
+
+  std::FILE * fp = fopen_input(filename);
+  if (fp == nullptr) {
+    fatal(error_prefix, "Unable to open manifest file for reading.");
+  }
+
+  std::string line;
+  int c {0};
+  while (c != EOF)
+    {
+      c = fgetc(fp);
+      if ((c != '\n') && (c != EOF))
+        {
+          if (c != '\r') {
+            line.push_back(static_cast<char>(c));
+          }
+          continue;
+        }
+      if ((! line.empty()) && (line[0] != '#'))
+        {
+          const auto tab = line.find('\t');
+          if (tab == std::string::npos)
+            {
+              p.sample_names.push_back(line);
+              p.seq_filenames.push_back(line);
+            }
+          else
+            {
+              p.sample_names.push_back(line.substr(0, tab));
+              p.seq_filenames.push_back(line.substr(tab + 1));
+            }
+        }
+      line.clear();
+    }
+  fclose(fp);
 }
 
 
 void args_check(std::array<int, n_options> & used_options) {
-  static constexpr unsigned int max_threads {1};
+  static constexpr unsigned int max_k {64};
+  static constexpr unsigned int max_k_narrow {32};
+  static constexpr unsigned int max_threads {256};
+  static constexpr unsigned int max_quality {93};
+  static constexpr unsigned int max_bloom_bits {64};
   // meaning of the used_options values
 
-  (void) used_options;
+  if (! p.opt_index.empty())
+    {
+      if (! p.opt_build_index.empty())
+        {
+          fatal(error_prefix,
+                "Options --index and --build-index cannot be used together.");
+        }
+      if ((used_options['k' - 'a'] != 0) || (used_options['m' - 'a'] != 0) ||
+          (used_options['e' - 'a'] != 0) || (used_options['p' - 'a'] != 0))
+        {
+          fatal(error_prefix,
+                "Options -k, -m, -e and -p cannot be used with --index,\n"
+                "they are taken from the index file.");
+        }
+    }
+
+  if ((! p.opt_build_index.empty()) && (! p.seq_filenames.empty()))
+    {
+      fatal(error_prefix,
+            "Sequence files cannot be given with --build-index.");
+    }
+
+  if (p.opt_view)
+    {
+      /* only the options for the text output */
+      for (const char c : std::string("abcefgikmpqrsx"))
+        {
+          if (used_options[static_cast<unsigned int>(c - 'a')] != 0)
+            {
+              fatal(error_prefix,
+                    "Only options -l, -n, -o and -t can be used with view.");
+            }
+        }
+    }
+
+  if ((p.opt_engine != "auto") && (p.opt_engine != "bloom") &&
+      (p.opt_engine != "direct"))
+    {
+      fatal(error_prefix,
+            "Unknown lookup engine specified with -g or --engine.\n"
+            "It must be auto, bloom or direct.");
+    }
+
+  if ((p.opt_output_format != "tsv") && (p.opt_output_format != "mtx") &&
+      (p.opt_output_format != "binary"))
+    {
+      fatal(error_prefix,
+            "Unknown output format specified with -x or --output-format.\n"
+            "It must be tsv, mtx or binary.");
+    }
+
+  if ((p.opt_output_format == "binary") && (p.seq_filenames.size() > 1))
+    {
+      fatal(error_prefix,
+            "The binary output format can only be used with one sequence file.");
+    }
+
+  if ((p.opt_output_format == "mtx") && p.opt_strand_counts)
+    {
+      fatal(error_prefix,
+            "Option --strand-counts cannot be used with the mtx output format.");
+    }
+
+  if (p.opt_top < 0)
+    {
+      fatal(error_prefix,
+            "Illegal number of kmers specified with -n or --top.\n"
+            "It must be 1 or more, or 0 for all.");
+    }
+
+  if (p.opt_per_record_kmers && p.opt_per_record.empty())
+    {
+      fatal(error_prefix,
+            "Option --per-record-kmers requires --per-record.");
+    }
+
+  if ((p.opt_bloom_bits < 0) || (p.opt_bloom_bits > max_bloom_bits))
+    {
+      fatal(error_prefix,
+            "Illegal number of bits specified with -e or --bloom-bits.\n"
+            "It must be in the range 1 to ", max_bloom_bits, ", or 0 for auto.");
+    }
+
+  if ((p.opt_bloom_pattern < 0) || (p.opt_bloom_pattern > bloomflex_max_k))
+    {
+      fatal(error_prefix,
+            "Illegal number of bits specified with -p or --bloom-k.\n"
+            "It must be in the range 1 to ", bloomflex_max_k, ", or 0 for auto.");
+    }
+
+  if ((p.opt_k < 1) || (p.opt_k > max_k))
+    {
+      fatal(error_prefix,
+	    "Illegal kmer length specified with -k or --kmer-length.\n"
+	    "It must be in the range 1 to ", max_k, ".");
+    }
+
+  if ((p.opt_k > max_k_narrow) && p.opt_mphf)
+    {
+      fatal(error_prefix,
+            "Option --mphf can only be used with kmers of up to ",
+            max_k_narrow, " nucleotides.");
+    }
+
+  if ((p.opt_k > max_k_narrow) && (p.opt_output_format == "binary"))
+    {
+      fatal(error_prefix,
+            "The binary output format can only be used with kmers of up to ",
+            max_k_narrow, " nucleotides.");
+    }
 
   if ((opt_threads < 1) || (opt_threads > max_threads))
     {
@@ -237,6 +594,13 @@ void args_check(std::array<int, n_options> & used_options) {
 	    "It must be in the range 1 to ", max_threads, ".");
     }
 
+  if ((p.opt_min_quality < 0) || (p.opt_min_quality > max_quality))
+    {
+      fatal(error_prefix,
+	    "Illegal minimum quality specified with -q or --min-quality.\n"
+	    "It must be in the range 0 to ", max_quality, ".");
+    }
+
   if (p.opt_help)
     {
       show(header_message);
@@ -290,8 +654,11 @@ auto main(int argc, char** argv) -> int
   open_files();
   show(header_message);
   args_show();
-  kmercount(p.kmer_filename.c_str(),
-	    p.seq_filename.c_str(),
-	    p.opt_k);
+  if (p.opt_view) {
+    kmercount_view(p);
+  }
+  else {
+    kmercount(p);
+  }
   close_files();
 }
@@ -40,7 +40,9 @@ constexpr char PRId64[] = "ld";
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <cerrno>
 #include <climits>
+#include <cmath>
 #include <cstdarg>
 #include <cstdint>
 #include <cstdio>
@@ -57,13 +59,18 @@ constexpr char PRId64[] = "ld";
 #include <vector>
 
 #ifdef __APPLE__
+#include <dlfcn.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/sysctl.h>
 #elif defined _WIN32
 #include <windows.h>
 #include <psapi.h>
 #else
+#include <dlfcn.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/sysinfo.h>
 #endif
 
@@ -87,6 +94,10 @@ constexpr char PRId64[] = "ld";
 #include <popcntintrin.h>
 #endif
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #elif defined __PPC__
 
 #ifdef __LITTLE_ENDIAN__
@@ -105,8 +116,15 @@ static_assert(INT_MAX > INT16_MAX, "Your compiler uses very short integers.");
 #include "arch.h"
 #include "bloomflex.h"
 #include "db.h"
+#include "decompress.h"
+#include "encode.h"
+#include "kmerhash.h"
+#include "mphf.h"
+#include "kmerindex.h"
+#include "writer.h"
+#include "countfile.h"
 #include "fatal.h"
-#include "pseudo_rng.h"
+#include "threads.h"
 #include "util.h"
 
 
@@ -133,10 +151,28 @@ extern queryinfo_t query;
 struct Parameters {
   bool opt_help {false};
   bool opt_version {false};
+  bool opt_canonical {false};
+  bool opt_strand_counts {false};
+  bool opt_mphf {false};
   int64_t opt_k {31};
+  int64_t opt_min_quality {0};
+  int64_t opt_top {0};
+  int64_t opt_bloom_bits {0};
+  int64_t opt_bloom_pattern {0};
   std::string kmer_filename {dash_filename};
-  std::string seq_filename {dash_filename};
+  std::vector<std::string> seq_filenames;
+  std::vector<std::string> sample_names;
+  std::string opt_manifest;
+  std::string opt_output_format {"tsv"};
+  std::string opt_engine {"auto"};
+  std::string opt_per_record;
+  bool opt_per_record_kmers {false};
   std::string opt_output_file {dash_filename};
+  std::string opt_index;
+  std::string opt_build_index;
+  bool opt_view {false};
+  std::string view_filename;
+  std::string view_kmer_filename;
 };
 
 extern std::string opt_log;  // used by multithreaded functions
@@ -171,6 +207,5 @@ inline auto nt_bytelength(unsigned int len) -> unsigned int
 
 /* functions in kmercount.cc */
 
-void kmercount(const char * kmer_filename,
-	       const char * seq_filename,
-	       int k);
+void kmercount(struct Parameters const & parameters);
+void kmercount_view(struct Parameters const & parameters);
@@ -0,0 +1,173 @@
+/*
+    Copyright (C) 2012-2023 Torbjorn Rognes and Frederic Mahe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Torbjorn Rognes <torognes@ifi.uio.no>,
+    Department of Informatics, University of Oslo,
+    PO Box 1080 Blindern, NO-0316 Oslo, Norway
+*/
+
+#include "main.h"
+
+struct mphf_key_s
+{
+  uint64_t key;
+  uint64_t hash;
+};
+
+auto mphf_level_build(struct mphf_s * m,
+                      unsigned int level,
+                      struct mphf_key_s * keys,
+                      uint64_t count) -> uint64_t
+{
+  /*
+    Add a level for count keys, with twice as many bits. Move the keys
+    that collide to the start of the array, and return their number.
+  */
+
+  static constexpr uint64_t gamma {2};
+  static constexpr uint64_t word_bits {64};
+
+  const uint64_t words = std::max(static_cast<uint64_t>(1),
+                                  (gamma * count + word_bits - 1) / word_bits);
+  m->level_bits[level] = words * word_bits;
+  m->level_offset[level] = m->words_count;
+  m->words_count += words;
+  m->words = static_cast<struct mphf_word_s *>
+    (xrealloc(m->words, m->words_count * sizeof(struct mphf_word_s)));
+  m->levels = level + 1;
+
+  /* mark the bits hit once, and those hit more than once */
+
+  auto * once = static_cast<uint64_t *>(xmalloc(words * sizeof(uint64_t)));
+  auto * more = static_cast<uint64_t *>(xmalloc(words * sizeof(uint64_t)));
+  memset(once, 0, words * sizeof(uint64_t));
+  memset(more, 0, words * sizeof(uint64_t));
+
+  for(uint64_t i = 0; i < count; i++)
+    {
+      const uint64_t pos = mphf_position(m, level, keys[i].key, keys[i].hash);
+      const uint64_t bit = 1ULL << (pos & 63U);
+      if ((once[pos >> 6U] & bit) != 0) {
+        more[pos >> 6U] |= bit;
+      }
+      else {
+        once[pos >> 6U] |= bit;
+      }
+    }
+
+  /* keep the keys that collided for the next level */
+
+  uint64_t left = 0;
+  for(uint64_t i = 0; i < count; i++)
+    {
+      const uint64_t pos = mphf_position(m, level, keys[i].key, keys[i].hash);
+      if ((more[pos >> 6U] & (1ULL << (pos & 63U))) != 0)
+        {
+          keys[left] = keys[i];
+          left++;
+        }
+    }
+
+  struct mphf_word_s * w = m->words + m->level_offset[level];
+  for(uint64_t i = 0; i < words; i++) {
+    w[i].bits = once[i] & ~ more[i];
+  }
+
+  xfree(once);
+  xfree(more);
+
+  return left;
+}
+
+auto mphf_init(const uint64_t * keys, const uint64_t * hashes, uint64_t count)
+  -> struct mphf_s *
+{
+  /*
+    Build the MPHF for the keys, with their rolling hashes used at the
+    first level. Repeated keys get only one slot.
+  */
+
+  const uint64_t alloc = std::max(count, static_cast<uint64_t>(1));
+
+  auto * m = static_cast<struct mphf_s *>(xmalloc(sizeof(struct mphf_s)));
+  m->levels = 0;
+  m->words_count = 0;
+  m->words = nullptr;
+
+  /* remove repeated keys first, they would collide at every level */
+
+  auto * left_keys = static_cast<struct mphf_key_s *>
+    (xmalloc(alloc * sizeof(struct mphf_key_s)));
+  for(uint64_t i = 0; i < count; i++)
+    {
+      left_keys[i].key = keys[i];
+      left_keys[i].hash = hashes[i];
+    }
+  std::sort(left_keys, left_keys + count,
+            [](const struct mphf_key_s & a, const struct mphf_key_s & b)
+            { return a.key < b.key; });
+  uint64_t left = static_cast<uint64_t>
+    (std::unique(left_keys, left_keys + count,
+                 [](const struct mphf_key_s & a, const struct mphf_key_s & b)
+                 { return a.key == b.key; }) - left_keys);
+
+  /* at least one level, then until all keys are placed */
+
+  for(auto level = 0U; level < mphf_max_levels; level++)
+    {
+      left = mphf_level_build(m, level, left_keys, left);
+      if (left == 0) {
+        break;
+      }
+    }
+
+  /* the number of bits set before each word */
+
+  uint64_t rank = 0;
+  for(uint64_t i = 0; i < m->words_count; i++)
+    {
+      m->words[i].rank = rank;
+      rank += static_cast<uint64_t>(__builtin_popcountll(m->words[i].bits));
+    }
+
+  /* the keys left after the last level, still sorted */
+
+  m->fallback_first = rank;
+  m->fallback_count = left;
+  m->fallback_keys = static_cast<uint64_t *>
+    (xmalloc(std::max(left, static_cast<uint64_t>(1)) * sizeof(uint64_t)));
+  for(uint64_t i = 0; i < left; i++) {
+    m->fallback_keys[i] = left_keys[i].key;
+  }
+  xfree(left_keys);
+
+  m->size = rank + m->fallback_count;
+  m->slots = static_cast<struct kmerhash_entry_s *>
+    (xmalloc_large(std::max(m->size, static_cast<uint64_t>(1)) *
+                   sizeof(struct kmerhash_entry_s)));
+  memset(m->slots, 0, m->size * sizeof(struct kmerhash_entry_s));
+
+  return m;
+}
+
+auto mphf_exit(struct mphf_s * m) -> void
+{
+  xfree(m->words);
+  xfree(m->fallback_keys);
+  xfree_large(m->slots, std::max(m->size, static_cast<uint64_t>(1)) *
+              sizeof(struct kmerhash_entry_s));
+  xfree(m);
+}
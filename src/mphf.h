@@ -0,0 +1,173 @@
+/*
+    Copyright (C) 2012-2023 Torbjorn Rognes and Frederic Mahe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Torbjorn Rognes <torognes@ifi.uio.no>,
+    Department of Informatics, University of Oslo,
+    PO Box 1080 Blindern, NO-0316 Oslo, Norway
+*/
+
+/*
+  Minimal perfect hash function (MPHF) over a static set of kmers, in
+  the style of BBHash, with a dense array of kmers and counts indexed
+  by its value.
+
+  Limasset A, Rizk G, Chikhi R, Peterlongo P (2017)
+  Fast and scalable minimal perfect hashing for massive key sets
+  16th International Symposium on Experimental Algorithms (SEA 2017)
+  https://doi.org/10.4230/LIPIcs.SEA.2017.25
+
+  The keys are hashed into a bit array of twice their number. Bits hit
+  by exactly one key are set, and those keys are placed. The other
+  keys go on to the next level, with a bit array twice their number,
+  and so on. The index of a key is the number of bits set before its
+  bit, over all the levels. Each word of bits is stored next to this
+  count for the words before it, so one cache line gives the index.
+  About 60% of the keys are placed at the first level, which uses the
+  rolling hash of the kmer. The few keys left after the last level
+  are kept in a sorted array.
+
+  Any kmer gives an index, so the kmer stored there must be compared.
+*/
+
+constexpr unsigned int mphf_max_levels {32};
+constexpr uint64_t mphf_none {UINT64_MAX};  // slot index for not found
+
+struct mphf_word_s
+{
+  uint64_t bits;
+  uint64_t rank;  /* number of bits set in the words before */
+};
+
+struct mphf_s
+{
+  uint64_t size;  /* number of kmers and slots */
+  unsigned int levels;
+  uint64_t level_offset[mphf_max_levels];  /* first word of each level */
+  uint64_t level_bits[mphf_max_levels];    /* size of each level in bits */
+  uint64_t words_count;
+  struct mphf_word_s * words;
+  uint64_t fallback_first;  /* slot of the first key left after the levels */
+  uint64_t fallback_count;
+  uint64_t * fallback_keys;  /* sorted */
+  struct kmerhash_entry_s * slots;
+};
+
+auto mphf_init(const uint64_t * keys, const uint64_t * hashes, uint64_t count) -> struct mphf_s *;
+
+void mphf_exit(struct mphf_s * m);
+
+inline auto mphf_mix(uint64_t key, unsigned int level) -> uint64_t
+{
+  /* hash of the key for levels after the first (MurmurHash3 finalizer) */
+  static constexpr uint64_t golden {0x9e3779b97f4a7c15};
+  uint64_t x = key + golden * level;
+  x ^= x >> 33U;
+  x *= 0xff51afd7ed558ccd;
+  x ^= x >> 33U;
+  x *= 0xc4ceb9fe1a85ec53;
+  x ^= x >> 33U;
+  return x;
+}
+
+inline auto mphf_position(struct mphf_s * m,
+                          unsigned int level,
+                          uint64_t key,
+                          uint64_t h) -> uint64_t
+{
+  /* bit position of the key in a level */
+  return arch_fastrange64((level == 0) ? h : mphf_mix(key, level),
+                          m->level_bits[level]);
+}
+
+inline auto mphf_word(struct mphf_s * m, unsigned int level, uint64_t pos)
+  -> struct mphf_word_s *
+{
+  return m->words + m->level_offset[level] + (pos >> 6U);
+}
+
+inline auto mphf_slot(struct mphf_word_s * w, uint64_t pos) -> uint64_t
+{
+  /* slot of the key at bit pos, or mphf_none if the bit is not set */
+  const uint64_t bit = 1ULL << (pos & 63U);
+  if ((w->bits & bit) == 0) {
+    return mphf_none;
+  }
+  return w->rank + static_cast<uint64_t>(__builtin_popcountll(w->bits & (bit - 1)));
+}
+
+inline void mphf_prefetch(struct mphf_s * m, uint64_t h)
+{
+  /* start loading the word of the first level */
+  __builtin_prefetch(mphf_word(m, 0, mphf_position(m, 0, 0, h)));
+}
+
+inline auto mphf_candidate(struct mphf_s * m, uint64_t h) -> uint64_t
+{
+  /*
+    With the word of the first level loaded, find the slot if the key
+    is placed at the first level, and start loading it. The slot is
+    given as a hint to mphf_find.
+  */
+  const uint64_t pos = mphf_position(m, 0, 0, h);
+  const uint64_t slot = mphf_slot(mphf_word(m, 0, pos), pos);
+  if (slot != mphf_none) {
+    __builtin_prefetch(m->slots + slot, 1);
+  }
+  return slot;
+}
+
+inline auto mphf_index(struct mphf_s * m, uint64_t key, uint64_t h) -> uint64_t
+{
+  /* the slot of the key, if it is in the set */
+
+  for(auto level = 0U; level < m->levels; level++)
+    {
+      const uint64_t pos = mphf_position(m, level, key, h);
+      const uint64_t slot = mphf_slot(mphf_word(m, level, pos), pos);
+      if (slot != mphf_none) {
+        return slot;
+      }
+    }
+
+  const uint64_t * begin = m->fallback_keys;
+  const uint64_t * end = begin + m->fallback_count;
+  const uint64_t * p = std::lower_bound(begin, end, key);
+  if ((p != end) && (*p == key)) {
+    return m->fallback_first + static_cast<uint64_t>(p - begin);
+  }
+  return mphf_none;
+}
+
+inline auto mphf_find(struct mphf_s * m,
+                      uint64_t h,
+                      uint64_t key,
+                      uint64_t kmer,
+                      uint64_t kmer_rc,
+                      uint64_t hint) -> uint64_t
+{
+  /*
+    Return the slot holding kmer or kmer_rc, or mphf_none. The key is
+    the kmer, or in canonical mode the smaller of kmer and kmer_rc.
+    A hint from mphf_candidate is the only possible slot.
+  */
+
+  const uint64_t slot = (hint != mphf_none) ? hint : mphf_index(m, key, h);
+  if (slot == mphf_none) {
+    return mphf_none;
+  }
+  const uint64_t x = m->slots[slot].kmer;
+  return ((x == kmer) || (x == kmer_rc)) ? slot : mphf_none;
+}
@@ -0,0 +1,160 @@
+/*
+    Copyright (C) 2012-2023 Torbjorn Rognes and Frederic Mahe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Torbjorn Rognes <torognes@ifi.uio.no>,
+    Department of Informatics, University of Oslo,
+    PO Box 1080 Blindern, NO-0316 Oslo, Norway
+*/
+
+#include <pthread.h>
+
+/*
+  Pool of worker threads. The threads are created once and then
+  woken up by run() to execute the given function, each with its own
+  thread number (0 to t-1) as argument. run() returns when all threads
+  have finished their work.
+*/
+
+class ThreadRunner
+{
+private:
+
+  struct thread_s
+  {
+    int64_t t;
+    void (*fun)(int64_t t);
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool work;
+    bool quit;
+  };
+
+  int64_t thread_count;
+  struct thread_s * thread_array;
+
+  static auto worker(void * vp) -> void *
+  {
+    auto * tip = static_cast<struct thread_s *>(vp);
+
+    pthread_mutex_lock(& tip->mutex);
+
+    /* loop until signalled to quit */
+    while (! tip->quit)
+      {
+        /* wait for work available */
+        if (! tip->work) {
+          pthread_cond_wait(& tip->cond, & tip->mutex);
+        }
+
+        if (tip->work)
+          {
+            (*tip->fun)(tip->t);
+            tip->work = false;
+            pthread_cond_signal(& tip->cond);
+          }
+      }
+
+    pthread_mutex_unlock(& tip->mutex);
+
+    return nullptr;
+  }
+
+public:
+
+  ThreadRunner(int64_t t, void (*f)(int64_t t))
+  {
+    thread_count = t;
+    thread_array = new thread_s[static_cast<uint64_t>(thread_count)];
+
+    pthread_attr_t attr;
+    pthread_attr_init(& attr);
+    pthread_attr_setdetachstate(& attr, PTHREAD_CREATE_JOINABLE);
+
+    /* init and create worker threads */
+
+    for(int64_t i = 0; i < thread_count; i++)
+      {
+        struct thread_s * tip = thread_array + i;
+        tip->t = i;
+        tip->fun = f;
+        tip->work = false;
+        tip->quit = false;
+        pthread_mutex_init(& tip->mutex, nullptr);
+        pthread_cond_init(& tip->cond, nullptr);
+        if (pthread_create(& tip->thread, & attr, worker, tip) != 0) {
+          fatal(error_prefix, "Cannot create thread.");
+        }
+      }
+
+    pthread_attr_destroy(& attr);
+  }
+
+  ThreadRunner(const ThreadRunner &) = delete;
+  auto operator=(const ThreadRunner &) -> ThreadRunner & = delete;
+
+  ~ThreadRunner()
+  {
+    /* ask threads to quit, then wait for them to finish */
+
+    for(int64_t i = 0; i < thread_count; i++)
+      {
+        struct thread_s * tip = thread_array + i;
+        pthread_mutex_lock(& tip->mutex);
+        tip->quit = true;
+        pthread_cond_signal(& tip->cond);
+        pthread_mutex_unlock(& tip->mutex);
+      }
+
+    for(int64_t i = 0; i < thread_count; i++)
+      {
+        struct thread_s * tip = thread_array + i;
+        if (pthread_join(tip->thread, nullptr) != 0) {
+          fatal(error_prefix, "Cannot join thread.");
+        }
+        pthread_cond_destroy(& tip->cond);
+        pthread_mutex_destroy(& tip->mutex);
+      }
+
+    delete [] thread_array;
+  }
+
+  auto run() -> void
+  {
+    /* wake up threads */
+
+    for(int64_t i = 0; i < thread_count; i++)
+      {
+        struct thread_s * tip = thread_array + i;
+        pthread_mutex_lock(& tip->mutex);
+        tip->work = true;
+        pthread_cond_signal(& tip->cond);
+        pthread_mutex_unlock(& tip->mutex);
+      }
+
+    /* wait for threads to finish their work */
+
+    for(int64_t i = 0; i < thread_count; i++)
+      {
+        struct thread_s * tip = thread_array + i;
+        pthread_mutex_lock(& tip->mutex);
+        while (tip->work) {
+          pthread_cond_wait(& tip->cond, & tip->mutex);
+        }
+        pthread_mutex_unlock(& tip->mutex);
+      }
+  }
+};
@@ -119,6 +119,126 @@ auto xfree(void * ptr) -> void
   }
 }
 
+#ifdef __linux__
+
+static constexpr size_t huge_page_size {2 << 20};
+static constexpr unsigned int max_numa_nodes {1024};
+
+auto numa_interleave(void * ptr, size_t size) -> void
+{
+  /*
+    With several threads, spread the pages over the NUMA nodes that
+    are online, instead of placing them all on the node of the thread
+    building the index, so that all threads share the memory bandwidth
+    of every node. Nothing is done with a single node, or if the
+    kernel refuses.
+  */
+
+  static constexpr int mpol_interleave {3};  // MPOL_INTERLEAVE in numaif.h
+  static constexpr unsigned int word_bits {64};
+
+  if (opt_threads < 2) {
+    return;
+  }
+
+  std::FILE * fp = fopen("/sys/devices/system/node/online", "r");
+  if (fp == nullptr) {
+    return;
+  }
+
+  /* a list of nodes and ranges of nodes, like 0-1,3 */
+
+  std::array<uint64_t, max_numa_nodes / word_bits> mask {{}};
+  unsigned int nodes = 0;
+  unsigned int first = 0;
+  unsigned int last = 0;
+  int fields = 0;
+  while ((fields = fscanf(fp, "%u-%u", & first, & last)) >= 1)
+    {
+      if (fields == 1) {
+        last = first;
+      }
+      for(auto node = first; (node <= last) && (node < max_numa_nodes); node++)
+        {
+          mask[node / word_bits] |= 1ULL << (node % word_bits);
+          nodes++;
+        }
+      if (fgetc(fp) != ',') {
+        break;
+      }
+    }
+  fclose(fp);
+
+  if (nodes > 1) {
+    syscall(SYS_mbind, ptr, size, mpol_interleave, mask.data(),
+            max_numa_nodes + 1, 0);
+  }
+}
+
+#endif
+
+
+auto xmalloc_large(size_t size) -> void *
+{
+  /*
+    Allocate a large array that is accessed at random, like the Bloom
+    filter and the hash table. The array gets pages of 2 MB where
+    possible, to avoid most of the TLB misses: huge pages reserved by
+    the administrator if there are enough of them, or else transparent
+    huge pages on a region aligned to 2 MB. The pages are interleaved
+    over the NUMA nodes. Smaller arrays, and arrays on other systems,
+    are allocated as usual. Free the array with xfree_large.
+  */
+
+#ifdef __linux__
+  if (size >= huge_page_size)
+    {
+      const size_t length = (size + huge_page_size - 1) & ~ (huge_page_size - 1);
+      void * t = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (t == MAP_FAILED)
+        {
+          /* one more page to find a boundary, the ends are unmapped */
+          void * region = mmap(nullptr, length + huge_page_size,
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+          if (region == MAP_FAILED) {
+            fatal(error_prefix, "Unable to allocate enough memory.");
+          }
+          const auto start = reinterpret_cast<uintptr_t>(region);
+          const size_t head = (huge_page_size - start % huge_page_size)
+            % huge_page_size;
+          if (head > 0) {
+            munmap(region, head);
+          }
+          t = static_cast<char *>(region) + head;
+          munmap(static_cast<char *>(t) + length, huge_page_size - head);
+          madvise(t, length, MADV_HUGEPAGE);
+        }
+      numa_interleave(t, length);
+      return t;
+    }
+#endif
+
+  return xmalloc(size);
+}
+
+auto xfree_large(void * ptr, size_t size) -> void
+{
+  /* free an array from xmalloc_large, of the size requested there */
+
+#ifdef __linux__
+  if ((ptr != nullptr) && (size >= huge_page_size))
+    {
+      const size_t length = (size + huge_page_size - 1) & ~ (huge_page_size - 1);
+      munmap(ptr, length);
+      return;
+    }
+#endif
+
+  xfree(ptr);
+}
+
 auto fopen_input(const char * filename) -> std::FILE *
 {
   /* open the input stream given by filename, but use stdin if name is - */
@@ -22,6 +22,8 @@
 auto xmalloc(size_t size) -> void *;
 auto xrealloc(void * ptr, size_t size) -> void *;
 auto xfree(void * ptr) -> void;
+auto xmalloc_large(size_t size) -> void *;
+auto xfree_large(void * ptr, size_t size) -> void;
 auto xgetline(char ** linep, size_t * linecapp, FILE * stream) -> ssize_t;
 auto progress_init(const char * prompt, uint64_t size) -> void;
 auto progress_update(uint64_t progress) -> void;
@@ -0,0 +1,109 @@
+/*
+    Copyright (C) 2012-2023 Torbjorn Rognes and Frederic Mahe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Torbjorn Rognes <torognes@ifi.uio.no>,
+    Department of Informatics, University of Oslo,
+    PO Box 1080 Blindern, NO-0316 Oslo, Norway
+*/
+
+#include "main.h"
+
+const char writer_nt4[] =
+    "AAAACAAAGAAATAAAACAACCAAGCAATCAAAGAACGAAGGAATGAAATAACTAAGTAATTAA"
+    "AACACACAGACATACAACCACCCAGCCATCCAAGCACGCAGGCATGCAATCACTCAGTCATTCA"
+    "AAGACAGAGAGATAGAACGACCGAGCGATCGAAGGACGGAGGGATGGAATGACTGAGTGATTGA"
+    "AATACATAGATATATAACTACCTAGCTATCTAAGTACGTAGGTATGTAATTACTTAGTTATTTA"
+    "AAACCAACGAACTAACACACCCACGCACTCACAGACCGACGGACTGACATACCTACGTACTTAC"
+    "AACCCACCGACCTACCACCCCCCCGCCCTCCCAGCCCGCCGGCCTGCCATCCCTCCGTCCTTCC"
+    "AAGCCAGCGAGCTAGCACGCCCGCGCGCTCGCAGGCCGGCGGGCTGGCATGCCTGCGTGCTTGC"
+    "AATCCATCGATCTATCACTCCCTCGCTCTCTCAGTCCGTCGGTCTGTCATTCCTTCGTTCTTTC"
+    "AAAGCAAGGAAGTAAGACAGCCAGGCAGTCAGAGAGCGAGGGAGTGAGATAGCTAGGTAGTTAG"
+    "AACGCACGGACGTACGACCGCCCGGCCGTCCGAGCGCGCGGGCGTGCGATCGCTCGGTCGTTCG"
+    "AAGGCAGGGAGGTAGGACGGCCGGGCGGTCGGAGGGCGGGGGGGTGGGATGGCTGGGTGGTTGG"
+    "AATGCATGGATGTATGACTGCCTGGCTGTCTGAGTGCGTGGGTGTGTGATTGCTTGGTTGTTTG"
+    "AAATCAATGAATTAATACATCCATGCATTCATAGATCGATGGATTGATATATCTATGTATTTAT"
+    "AACTCACTGACTTACTACCTCCCTGCCTTCCTAGCTCGCTGGCTTGCTATCTCTCTGTCTTTCT"
+    "AAGTCAGTGAGTTAGTACGTCCGTGCGTTCGTAGGTCGGTGGGTTGGTATGTCTGTGTGTTTGT"
+    "AATTCATTGATTTATTACTTCCTTGCTTTCTTAGTTCGTTGGTTTGTTATTTCTTTGTTTTTTT";
+
+const char writer_digits2[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+auto writer_init(std::FILE * fp) -> struct writer_s *
+{
+  /* anything already printed to fp is written first */
+  if (fflush(fp) != 0) {
+    fatal(error_prefix, "Unable to write to output file.");
+  }
+
+  auto * w = static_cast<struct writer_s *>(xmalloc(sizeof(struct writer_s)));
+  w->fd = fileno(fp);
+  w->size = writer_buffer_size;
+  w->used = 0;
+  w->buffer = static_cast<char *>(xmalloc(w->size));
+  return w;
+}
+
+auto writer_output(int fd, const char * text, uint64_t length) -> void
+{
+  uint64_t done = 0;
+  while (done < length)
+    {
+      const ssize_t n = write(fd, text + done, length - done);
+      if (n < 0)
+        {
+          if (errno == EINTR) {
+            continue;
+          }
+          fatal(error_prefix, "Unable to write to output file.");
+        }
+      done += static_cast<uint64_t>(n);
+    }
+}
+
+auto writer_flush(struct writer_s * w) -> void
+{
+  writer_output(w->fd, w->buffer, w->used);
+  w->used = 0;
+}
+
+auto writer_write(struct writer_s * w, const char * text, uint64_t length)
+  -> void
+{
+  /* long texts are written directly, without copying */
+  if (w->used + length > w->size) {
+    writer_flush(w);
+  }
+  if (length > w->size) {
+    writer_output(w->fd, text, length);
+  }
+  else
+    {
+      memcpy(w->buffer + w->used, text, length);
+      w->used += length;
+    }
+}
+
+auto writer_exit(struct writer_s * w) -> void
+{
+  writer_flush(w);
+  xfree(w->buffer);
+  xfree(w);
+}
@@ -0,0 +1,117 @@
+/*
+    Copyright (C) 2012-2023 Torbjorn Rognes and Frederic Mahe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Torbjorn Rognes <torognes@ifi.uio.no>,
+    Department of Informatics, University of Oslo,
+    PO Box 1080 Blindern, NO-0316 Oslo, Norway
+*/
+
+/*
+  Fast output of results. Kmers are decoded four nucleotides at a
+  time with a table lookup, and integers are formatted two digits at a
+  time, without printf. The text is collected in a large buffer that
+  is written to the file descriptor with write() when it gets full.
+*/
+
+constexpr uint64_t writer_buffer_size {4 * 1024 * 1024};
+
+/* the longest text of a formatted kmer and of an unsigned integer */
+constexpr unsigned int writer_kmer_max {64};
+constexpr unsigned int writer_uint64_max {20};
+
+/* four nt (first nt in the lowest bits) for each byte of a kmer */
+extern const char writer_nt4[];
+
+/* the two digits of each number from 00 to 99 */
+extern const char writer_digits2[];
+
+struct writer_s
+{
+  int fd;
+  char * buffer;
+  uint64_t size;
+  uint64_t used;
+};
+
+inline auto writer_format_kmer(char * p, uint64_t kmer, unsigned int k)
+  -> char *
+{
+  /* k symbols, not terminated, but up to 3 more bytes may be written */
+  for (unsigned int i = 0; i < k; i += 4)
+    {
+      memcpy(p + i, writer_nt4 + 4 * (kmer & 255U), 4);
+      kmer >>= 8U;
+    }
+  return p + k;
+}
+
+inline auto writer_format_kmer(char * p, uint64_t kmer, uint64_t high,
+                               unsigned int k) -> char *
+{
+  /* as above, for up to 64 symbols, the first 32 in kmer and the
+     others in high */
+  if (k <= 32) {
+    return writer_format_kmer(p, kmer, k);
+  }
+  p = writer_format_kmer(p, kmer, 32);
+  return writer_format_kmer(p, high, k - 32);
+}
+
+inline auto writer_format_uint(char * p, uint64_t value) -> char *
+{
+  /* the decimal digits of value, not terminated */
+  unsigned int digits = 1;
+  for (uint64_t v = value; v >= 10; v /= 10) {
+    digits++;
+  }
+  char * q = p + digits;
+  while (value >= 100)
+    {
+      q -= 2;
+      memcpy(q, writer_digits2 + 2 * (value % 100), 2);
+      value /= 100;
+    }
+  if (value >= 10) {
+    memcpy(q - 2, writer_digits2 + 2 * value, 2);
+  }
+  else {
+    * (q - 1) = static_cast<char>('0' + value);
+  }
+  return p + digits;
+}
+
+auto writer_init(std::FILE * fp) -> struct writer_s *;
+
+auto writer_write(struct writer_s * w, const char * text, uint64_t length)
+  -> void;
+
+auto writer_flush(struct writer_s * w) -> void;
+
+auto writer_exit(struct writer_s * w) -> void;
+
+inline auto writer_reserve(struct writer_s * w, uint64_t length) -> char *
+{
+  /* room for at least length bytes, to be used with writer_commit */
+  if (w->used + length > w->size) {
+    writer_flush(w);
+  }
+  return w->buffer + w->used;
+}
+
+inline auto writer_commit(struct writer_s * w, const char * end) -> void
+{
+  w->used = static_cast<uint64_t>(end - w->buffer);
+}
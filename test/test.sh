@@ -8,6 +8,156 @@ fi
 
 ../src/kmercount -k 31 kmers.fasta seq.fasta -l kmercount.log -o counts.tsv
 
+if ! diff -q counts.tsv expected.tsv; then
+    echo Test failed.
+    exit 1
+fi
+
+../src/kmercount -k 31 kmers.fasta seq.fastq -l kmercount.log -o counts.tsv
+
+if ! diff -q counts.tsv expected.tsv; then
+    echo Test failed.
+    exit 1
+fi
+
+../src/kmercount -k 31 --mphf kmers.fasta seq.fasta -l kmercount.log -o counts.tsv
+
+if ! diff -q counts.tsv expected.tsv; then
+    echo Test failed.
+    exit 1
+fi
+
+../src/kmercount -k 31 --build-index kmercount.idx kmers.fasta -l kmercount.log
+../src/kmercount --index kmercount.idx seq.fasta -l kmercount.log -o counts.tsv
+
+if ! diff -q counts.tsv expected.tsv; then
+    echo Test failed.
+    exit 1
+fi
+
+# sequence files are not counted when building an index
+if ../src/kmercount -k 31 --build-index damaged.idx kmers.fasta seq.fasta \
+                    -l kmercount.log 2> error.log || \
+        ! grep -q "cannot be given with --build-index" error.log; then
+    echo Test failed.
+    exit 1
+fi
+
+# a truncated index, and ones with no hash table buckets or more
+# entries than the table can hold, are rejected
+head -c 4000 kmercount.idx > damaged.idx
+if ../src/kmercount --index damaged.idx seq.fasta -l kmercount.log \
+                    -o counts.tsv 2> error.log || \
+        ! grep -q "index file is damaged" error.log; then
+    echo Test failed.
+    exit 1
+fi
+
+cp kmercount.idx damaged.idx
+printf '\000\000\000\000\000\000\000\000' | \
+    dd of=damaged.idx bs=1 seek=40 conv=notrunc 2> /dev/null
+if ../src/kmercount --index damaged.idx seq.fasta -l kmercount.log \
+                    -o counts.tsv 2> error.log || \
+        ! grep -q "index file is damaged" error.log; then
+    echo Test failed.
+    exit 1
+fi
+
+cp kmercount.idx damaged.idx
+printf '\377\377\377\377\377\377\377\377' | \
+    dd of=damaged.idx bs=1 seek=48 conv=notrunc 2> /dev/null
+if ../src/kmercount --index damaged.idx seq.fasta -l kmercount.log \
+                    -o counts.tsv 2> error.log || \
+        ! grep -q "index file is damaged" error.log; then
+    echo Test failed.
+    exit 1
+fi
+rm -f kmercount.idx damaged.idx error.log
+
+../src/kmercount -k 31 -x binary kmers.fasta seq.fasta -l kmercount.log \
+                 -o counts.bin
+../src/kmercount view counts.bin -l kmercount.log -o counts.tsv
+
+if ! diff -q counts.tsv expected.tsv; then
+    echo Test failed.
+    exit 1
+fi
+
+# only the kmers of a kmer file, looked up in the count file
+printf '>a\nCCCCCCCCCCCCCCCCCCCCCCCCCCCCCCC\n>b\nAAATGAGAAGTAATCAGAAAACCACTTAAGG\n' | \
+    ../src/kmercount view counts.bin - -l kmercount.log -o counts.tsv
+rm -f counts.bin
+
+if [ "$(cat counts.tsv)" != "$(grep '^AAATGAGAAG' expected.tsv)" ]; then
+    echo Test failed.
+    exit 1
+fi
+
+# matches of each record
+../src/kmercount -k 31 kmers.fasta seq.fasta -l kmercount.log -o counts.tsv \
+                 --per-record records.tsv
+
+if [ "$(cat records.tsv)" != "$(printf 'seq\t4')" ]; then
+    echo Test failed.
+    exit 1
+fi
+rm -f records.tsv
+
+# a leading record of only low quality bases has no parts, and the
+# next record still gets its matches
+sed 's/^@seq$/@r0/; 4s/I/#/g' seq.fastq > lowq.fastq
+sed 's/^@seq$/@r1/' seq.fastq >> lowq.fastq
+sed 's/^@seq$/@r2/' seq.fastq >> lowq.fastq
+../src/kmercount -k 31 -q 20 kmers.fasta lowq.fastq -l kmercount.log \
+                 -o counts.tsv --per-record records.tsv
+
+if [ "$(cat records.tsv)" != "$(printf 'r0\t0\nr1\t4\nr2\t4')" ]; then
+    echo Test failed.
+    exit 1
+fi
+rm -f lowq.fastq records.tsv
+
+# only the most frequent kmers
+../src/kmercount -k 31 --top 2 kmers.fasta seq.fasta -l kmercount.log \
+                 -o counts.tsv
+
+if [ "$(cat counts.tsv)" != "$(head -n 2 expected.tsv)" ]; then
+    echo Test failed.
+    exit 1
+fi
+
+# one column for each sequence file
+../src/kmercount -k 31 kmers.fasta seq.fasta seq.fastq -l kmercount.log | \
+    awk 'NR > 1 && $2 == $3 { print $1 "\t" $2 }' > counts.tsv
+
+if ! diff -q counts.tsv expected.tsv; then
+    echo Test failed.
+    exit 1
+fi
+
+gzip -c seq.fasta | \
+    ../src/kmercount -k 31 kmers.fasta - -l kmercount.log -o counts.tsv
+
+if ! diff -q counts.tsv expected.tsv; then
+    echo Test failed.
+    exit 1
+fi
+
+# kmers longer than 32 nucleotides, the second on the reverse strand
+printf '>k1\nAAGAAATGAGAAGTAATCAGAAAACCACTTAAG\n>k2\nCCTTAAGTGGTTTTCTGATTACTTCTCATTTCT\n' | \
+    ../src/kmercount -k 33 --strand-counts - seq.fasta -l kmercount.log \
+                     -o counts.tsv
+
+if [ "$(cat counts.tsv)" != "$(printf 'AAGAAATGAGAAGTAATCAGAAAACCACTTAAG\t1\t1\t0\nCCTTAAGTGGTTTTCTGATTACTTCTCATTTCT\t1\t0\t1')" ]; then
+    echo Test failed.
+    exit 1
+fi
+
+# the reverse complement of the sequence gives the same canonical counts
+{ echo '>rc' ; grep -v '^>' seq.fasta | rev | tr ACGT TGCA ; } | \
+    ../src/kmercount -k 31 --canonical kmers.fasta - \
+                     -l kmercount.log -o counts.tsv
+
 if diff -q counts.tsv expected.tsv; then
     echo Test completed successfully.
 else